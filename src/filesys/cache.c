@@ -1,120 +1,1068 @@
 
 #include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include "filesys/filesys.h"
 #include "threads/synch.h"
 #include "filesys/cache.h"
-//#include "devices/timer.h"
-//#include "threads/malloc.h"
-//#include "threads/thread.h"
+#include "filesys/free-map.h"
+#include "devices/timer.h"
+#include "threads/loader.h"
+#include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/thread.h"
+#include "threads/vaddr.h"
 
-//#define INVALID_SECTOR ((block_sector_t) 0xffffffff)
+/* Replacement queue a cache block is on.  Protected by
+   cache_sync. */
+enum cache_queue
+  {
+    Q_NONE,         /* Being moved between queues. */
+    Q_FREE,         /* free_blocks. */
+    Q_CLOCK,        /* In use under the clock policy, which has no queue. */
+    Q_A1IN,         /* 2Q: a1in, sectors referenced once recently. */
+    Q_AM            /* 2Q: am, sectors referenced again since. */
+  };
 
+/* A cached sector.
 
+   Lock order is cache_sync, then block_lock, then data_lock.
+   Whoever holds more than one block at a time locks them, and
+   takes their data_locks, in increasing sector order.  Disk I/O is only ever done while holding a block's read or
+   write lock (or data_lock), never cache_sync, so a miss on one
+   block does not hold up hits on the others. */
 struct cache_block  {
+    /* Reader/writer lock that pins the block in the cache. */
+    struct lock block_lock;                 /* Protects this group. */
+    struct condition no_readers_or_writers; /* readers == 0 && writers == 0 */
+    struct condition no_writers;            /* writers == 0 */
+    int readers, read_waiters;              /* # of readers, # waiting. */
+    int writers, write_waiters;             /* # of writers (<= 1), # waiting. */
+    bool accessed;                          /* Used recently, for the clock. */
+
+    /* Sector held, or NULL_SECTOR if the block is free.
+       Changing it requires cache_sync and block_lock, and a
+       block may only be freed when nobody holds or waits for it. */
     block_sector_t sector;
+    struct hash_elem hash_elem;   /* Element in cache_index, if in use. */
+    enum cache_queue queue;       /* Queue queue_elem is on. */
+    struct list_elem queue_elem;  /* Element in free_blocks, a1in or am. */
+
+    /* True if data[] holds the sector's contents.
+       Requires the write lock or data_lock to set. */
+    bool up_to_date;
+
+    /* True if data[] must be written back.  Valid only when
+       up_to_date.  Requires the read or write lock. */
     bool dirty;
-    bool accessed;
-    uint8_t data[BLOCK_SECTOR_SIZE];
+
+    struct lock data_lock;        /* Serializes reading data[] from disk. */
+    uint8_t *data;                /* BLOCK_SECTOR_SIZE bytes in a chunk page. */
+};
+
+/* Cache blocks are allocated a chunk at a time.  The data of a
+   chunk's blocks fills exactly one palloc'd page, so the cache's
+   memory footprint follows its configured size. */
+#define CHUNK_BLOCKS (PGSIZE / BLOCK_SECTOR_SIZE)
+struct cache_chunk {
+    struct cache_block blocks[CHUNK_BLOCKS];
+    void *page;                   /* Data of blocks[]. */
 };
 
 /* Cache. */
-#define CACHE_CNT 64
-struct cache_block cache[CACHE_CNT];
-struct lock cache_sync;
-static int hand = 0;
+#define DEFAULT_CACHE_CNT 64
+#define POOL_SHARE 4                  /* At most 1/POOL_SHARE of kernel pool. */
+static size_t cache_size = DEFAULT_CACHE_CNT; /* Requested block count. */
+static struct cache_chunk **chunks;   /* Array of chunk_cnt chunks. */
+static size_t chunk_cnt;
+static size_t cache_cnt;              /* chunk_cnt * CHUNK_BLOCKS. */
+struct lock cache_sync;         /* Protects the above, cache_index, hand, stats. */
+static size_t hand = 0;
 
-static void cache_write_back(struct cache_block* block);
-static struct cache_block* cache_search(block_sector_t sector);
-struct cache_block* cache_evict();
+/* Maps a sector number to the cache block holding it.
+   Contains exactly the blocks whose sector is not NULL_SECTOR.
+   Protected by cache_sync. */
+static struct hash cache_index;
+
+/* Blocks that hold no sector.  Protected by cache_sync. */
+static struct list free_blocks;
+
+/* Replacement policy, chosen at boot. */
+enum cache_policy
+  {
+    POLICY_CLOCK,   /* Second-chance clock over all blocks. */
+    POLICY_2Q       /* Scan-resistant 2Q. */
+  };
+static enum cache_policy policy = POLICY_CLOCK;
+
+/* 2Q state, protected by cache_sync.
+
+   A sector seen for the first time enters a1in, a FIFO, and is
+   not promoted by further hits there, so a long sequential scan
+   only ever cycles through a1in.  A sector evicted from a1in is
+   remembered, without its data, in the ghost queue a1out; if it
+   is read again while still remembered, it goes to am, an LRU
+   queue of sectors that have proven to be reused.  Victims come
+   from a1in while it holds more than a quarter of the cache, and
+   from am otherwise. */
+static struct list a1in;          /* Front is oldest. */
+static size_t a1in_cnt;           /* Number of blocks on a1in. */
+static struct list am;            /* Front is least recently used. */
+
+/* An a1out entry: a sector recently evicted from a1in. */
+struct ghost
+  {
+    struct hash_elem hash_elem;   /* Element in ghost_index. */
+    struct list_elem list_elem;   /* Element in a1out. */
+    block_sector_t sector;
+  };
+static struct hash ghost_index;   /* Sector to a1out entry. */
+static struct list a1out;         /* Front is oldest. */
+static size_t a1out_cnt;          /* At most half the cache size. */
+
+/* Write-behind.  flushd writes all dirty blocks back every
+   flush_interval milliseconds, or sooner once at least dirty_ratio
+   percent of the cache is dirty. */
+#define FLUSHD_POLL_MS 100          /* How often flushd checks dirty_cnt. */
+static int flush_interval = 5000;   /* Milliseconds between flushes. */
+static int dirty_ratio = 25;        /* Percent dirty that forces a flush. */
+static int dirty_cnt;               /* Number of dirty blocks. */
+static struct lock dirty_lock;      /* Protects dirty_cnt and below. */
+static long long writeback_cnt;     /* Dirty blocks written back. */
+static long long writeback_req_cnt; /* Device requests they took. */
+
+/* Clustered write-back.  Dirty blocks for consecutive sectors are
+   written back together, up to CLUSTER_MAX at a time, with one
+   block_write_multiple() request through a page of staging. */
+#define CLUSTER_MAX CHUNK_BLOCKS
+
+/* Lookup statistics, protected by cache_sync.  Lookups made for
+   read-ahead are not counted, so the hit rate is the one seen by
+   cache_lock() callers. */
+static long long lookup_cnt;    /* Demand lookups. */
+static long long hit_cnt;       /* Demand lookups that found the sector. */
+static long long compare_cnt;   /* Key comparisons made in cache_index. */
+
+static struct cache_block* cache_block_at(size_t idx);
+static bool cache_grow(void);
+static struct cache_block* cache_search(block_sector_t sector, bool demand);
+static struct cache_block* lock_block(block_sector_t sector, enum lock_type type,
+                                      bool demand, bool wait);
+static bool cache_busy(struct cache_block* block);
+static struct cache_block* first_idle(struct list* list);
+static struct cache_block* clock_victim(void);
+static struct cache_block* twoq_victim(void);
+static void ghost_add(block_sector_t sector);
+static bool ghost_remove(block_sector_t sector);
+static void cache_install(struct cache_block* block, block_sector_t sector);
+static void cache_uninstall(struct cache_block* block);
+static void cache_wait(struct cache_block* block, enum lock_type type);
+
+static void set_dirty(struct cache_block* block, bool dirty);
+static bool try_share(struct cache_block* block);
+static size_t gather_cluster(struct cache_block* victim,
+                             struct cache_block** run);
+static void write_cluster(struct cache_block** run, size_t cnt,
+                          uint8_t* staging);
+static void flush_each(void);
+static int sector_cmp(const void* a, const void* b);
+
+static hash_hash_func cache_block_hash;
+static hash_less_func cache_block_less;
+static hash_hash_func ghost_hash;
+static hash_less_func ghost_less;
+
+static void readaheadd_init (void);
+static void flushd_init (void);
 
 /* Initializes cache. */
 void cache_init (void) 
 {
 	lock_init(&cache_sync);
+	lock_init(&dirty_lock);
+	if (!hash_init(&cache_index, cache_block_hash, cache_block_less, NULL)
+	    || !hash_init(&ghost_index, ghost_hash, ghost_less, NULL))
+		PANIC ("out of memory allocating buffer cache index");
+	list_init(&free_blocks);
+	list_init(&a1in);
+	list_init(&am);
+	list_init(&a1out);
+	while (cache_cnt < cache_size && cache_grow())
+		continue;
+	if (cache_cnt == 0)
+		PANIC ("out of memory allocating buffer cache");
+	if (cache_cnt < cache_size)
+		printf ("buffer cache: only %zu of %zu sectors allocated\n",
+		        cache_cnt, cache_size);
+	readaheadd_init();
+	flushd_init();
+}
+
+/* Selects the replacement policy named NAME, "clock" or "2q".
+   Returns false if NAME is unknown.  Must be called before
+   cache_init(). */
+bool cache_set_policy (const char *name)
+{
+	if (!strcmp (name, "clock"))
+		policy = POLICY_CLOCK;
+	else if (!strcmp (name, "2q"))
+		policy = POLICY_2Q;
+	else
+		return false;
+	return true;
+}
+
+/* Sets the number of sectors the cache holds to CNT, rounded up
+   to a whole page of sectors.  A CNT that would take more than
+   1/POOL_SHARE of the kernel pool, which would leave too little
+   for the rest of the kernel, is cut down to that much.  Returns
+   false if CNT is not positive.  Must be called before
+   cache_init(), but may be called before palloc_init(). */
+bool cache_set_size (int cnt)
+{
+	/* palloc_init() gives the kernel pool at least half of the
+	   memory above 1 MB. */
+	size_t free_pages = init_ram_pages - 1024 * 1024 / PGSIZE;
+	size_t max = (free_pages - free_pages / 2) / POOL_SHARE * CHUNK_BLOCKS;
+
+	if (cnt <= 0)
+		return false;
+	cache_size = cnt;
+	if (cache_size > max) {
+		printf ("buffer cache: %zu sectors is too many, using %zu\n",
+		        cache_size, max);
+		cache_size = max;
+	}
+	return true;
+}
+
+/* Returns the cache block with index IDX.
+   Must be called with cache_sync held. */
+static struct cache_block* cache_block_at(size_t idx) {
+	ASSERT (idx < cache_cnt);
+	return &chunks[idx / CHUNK_BLOCKS]->blocks[idx % CHUNK_BLOCKS];
+}
+
+/* Adds a chunk of free blocks to the cache.  Returns false if
+   out of memory.  Called only by cache_init(). */
+static bool cache_grow(void) {
+	struct cache_chunk** new_chunks;
+	struct cache_chunk* c;
 	int i;
-	for (i = 0; i < CACHE_CNT; i++) {
-		struct cache_block* cur = &cache[i];
+
+	new_chunks = realloc(chunks, sizeof *chunks * (chunk_cnt + 1));
+	if (new_chunks == NULL)
+		return false;
+	chunks = new_chunks;
+
+	c = malloc(sizeof *c);
+	if (c == NULL)
+		return false;
+	c->page = palloc_get_page(0);
+	if (c->page == NULL) {
+		free(c);
+		return false;
+	}
+	for (i = 0; i < CHUNK_BLOCKS; i++) {
+		struct cache_block* cur = &c->blocks[i];
+		lock_init(&cur->block_lock);
+		cond_init(&cur->no_readers_or_writers);
+		cond_init(&cur->no_writers);
+		cur->readers = cur->read_waiters = 0;
+		cur->writers = cur->write_waiters = 0;
+		cur->accessed = false;
 		cur->sector = NULL_SECTOR;	
+		cur->queue = Q_FREE;
+		list_push_back(&free_blocks, &cur->queue_elem);
+		cur->up_to_date = false;
 		cur->dirty = false;
+		lock_init(&cur->data_lock);
+		cur->data = (uint8_t *) c->page + i * BLOCK_SECTOR_SIZE;
 	}
+	chunks[chunk_cnt++] = c;
+	cache_cnt += CHUNK_BLOCKS;
+	return true;
 }
 
-void cache_write_back(struct cache_block* block) {
-  if (block->dirty == true) {
-    block_write(fs_device, block->sector, block->data);
-    block->dirty = false;
-    block->sector = NULL_SECTOR;
-  }
+/* Sets the write-behind interval to INTERVAL_MS milliseconds.
+   Returns false if INTERVAL_MS is not positive.
+   May be called before cache_init(). */
+bool cache_set_flush_interval (int interval_ms)
+{
+	if (interval_ms <= 0)
+		return false;
+	flush_interval = interval_ms;
+	return true;
+}
+
+/* Makes write-behind start as soon as RATIO percent of the cache
+   is dirty.  Returns false unless RATIO is between 1 and 100.
+   May be called before cache_init(). */
+bool cache_set_dirty_ratio (int ratio)
+{
+	if (ratio <= 0 || ratio > 100)
+		return false;
+	dirty_ratio = ratio;
+	return true;
 }
 
+/* Flushes all cache to disk.
 
-/* Flushes all cache to disk. */
+   The dirty blocks that can be locked right away are written back
+   in sector order, with runs of consecutive sectors clustered
+   into single requests.  Any that were being written at the time
+   are then flushed one by one, waiting for their writers. */
 void cache_flush (void) {
+  struct cache_block** dirty;
+  uint8_t* staging;
+  size_t cnt = 0, busy = 0;
+  size_t i, j;
+
   lock_acquire(&cache_sync);
-  int i;
-  for (i = 0; i < CACHE_CNT; i++) {
-    if (cache[i].sector != NULL_SECTOR)
-      cache_write_back(&cache[i]);
+  dirty = malloc(sizeof *dirty * cache_cnt);
+  if (dirty == NULL) {
+    lock_release(&cache_sync);
+    flush_each();
+    return;
+  }
+  for (i = 0; i < cache_cnt; i++) {
+    struct cache_block* b = cache_block_at(i);
+    if (b->sector == NULL_SECTOR)
+      continue;
+    if (try_share(b))
+      dirty[cnt++] = b;
+    else if (b->writers || b->write_waiters)
+      busy++;
   }
   lock_release(&cache_sync);
+
+  /* The shared locks keep the blocks from being changed, evicted
+     until written. */
+  qsort(dirty, cnt, sizeof *dirty, sector_cmp);
+  staging = palloc_get_page(0);
+  for (i = 0; i < cnt; i = j) {
+    size_t k;
+
+    for (j = i + 1; j < cnt && j - i < CLUSTER_MAX; j++)
+      if (dirty[j]->sector != dirty[j - 1]->sector + 1)
+        break;
+    write_cluster(dirty + i, j - i, staging);
+    for (k = i; k < j; k++)
+      cache_unlock(dirty[k]);
+  }
+  palloc_free_page(staging);
+  free(dirty);
+
+  if (busy)
+    flush_each();
+}
+
+/* Flushes the cache one block at a time, waiting for each block
+   that is being written. */
+static void flush_each (void) {
+  size_t i;
+  for (i = 0; ; i++) {
+    struct cache_block* b;
+
+    /* Take block_lock before dropping cache_sync, so that the
+       block cannot be evicted meanwhile. */
+    lock_acquire(&cache_sync);
+    if (i >= cache_cnt) {
+      lock_release(&cache_sync);
+      break;
+    }
+    b = cache_block_at(i);
+    lock_acquire(&b->block_lock);
+    lock_release(&cache_sync);
+
+    if (b->sector == NULL_SECTOR) {
+      lock_release(&b->block_lock);
+      continue;
+    }
+    /* A shared lock keeps writers out and pins the sector. */
+    cache_wait(b, NON_EXCLUSIVE);
+    lock_release(&b->block_lock);
+
+    if (b->up_to_date && b->dirty)
+      write_cluster(&b, 1, NULL);
+    cache_unlock(b);
+  }
 }
 
+/* If BLOCK is dirty and nobody is writing or waiting to write it,
+   takes a shared lock on it for writing it back and returns true.
+   Otherwise returns false without locking it. */
+static bool try_share(struct cache_block* b) {
+  bool shared = false;
 
-struct cache_block* cache_search(block_sector_t sector) {
-  int i;
-  for (i = 0; i < CACHE_CNT; i++) {
-    if (cache[i].sector == sector)
-      return &cache[i];
+  lock_acquire(&b->block_lock);
+  if (b->sector != NULL_SECTOR && b->up_to_date && b->dirty
+      && !b->writers && !b->write_waiters) {
+    b->readers++;
+    shared = true;
   }
-  return NULL;
+  lock_release(&b->block_lock);
+  return shared;
 }
 
-struct cache_block* cache_evict() {
-  while (1) {
-    if (cache[hand].sector == NULL_SECTOR)
-      return &cache[hand];
+/* Fills RUN with the cluster to write back along with VICTIM,
+   which the caller has write-locked for eviction: the dirty
+   blocks for the sectors just before VICTIM's, VICTIM itself, and
+   those just after, in sector order.  The neighbors are locked
+   shared.  Returns the number of blocks in RUN, at most
+   CLUSTER_MAX.
+   Must be called with cache_sync held, but not VICTIM's
+   block_lock. */
+static size_t gather_cluster(struct cache_block* victim,
+                             struct cache_block** run) {
+  struct cache_block* before[CLUSTER_MAX - 1];
+  size_t before_cnt = 0, cnt = 0;
+  block_sector_t s;
 
-    if (cache[hand].accessed == true) {
-      cache[hand].accessed = false;
-    } else {
+  ASSERT (lock_held_by_current_thread (&cache_sync));
+  for (s = victim->sector; s > 0 && before_cnt < CLUSTER_MAX - 1; s--) {
+    struct cache_block* b = cache_search(s - 1, false);
+    if (b == NULL || !try_share(b))
       break;
+    before[before_cnt++] = b;
+  }
+  while (before_cnt > 0)
+    run[cnt++] = before[--before_cnt];
+  run[cnt++] = victim;
+  for (s = victim->sector + 1; cnt < CLUSTER_MAX && s != NULL_SECTOR; s++) {
+    struct cache_block* b = cache_search(s, false);
+    if (b == NULL || !try_share(b))
+      break;
+    run[cnt++] = b;
+  }
+  return cnt;
+}
+
+/* Writes back the CNT locked, dirty blocks in RUN, which hold
+   consecutive sectors, and marks them clean.  With a STAGING page
+   they are written in a single request; if STAGING is null, one
+   sector at a time. */
+static void write_cluster(struct cache_block** run, size_t cnt,
+                          uint8_t* staging) {
+  size_t i;
+
+  ASSERT (cnt >= 1 && cnt <= CLUSTER_MAX);
+  if (cnt > 1 && staging != NULL) {
+    for (i = 0; i < cnt; i++)
+      memcpy(staging + i * BLOCK_SECTOR_SIZE, run[i]->data, BLOCK_SECTOR_SIZE);
+    block_write_multiple(fs_device, run[0]->sector, cnt, staging);
+  } else
+    for (i = 0; i < cnt; i++)
+      block_write(fs_device, run[i]->sector, run[i]->data);
+
+  for (i = 0; i < cnt; i++)
+    set_dirty(run[i], false);
+  lock_acquire(&dirty_lock);
+  writeback_cnt += cnt;
+  writeback_req_cnt += staging != NULL ? 1 : cnt;
+  lock_release(&dirty_lock);
+}
+
+/* Read-ahead statistics, protected by readahead_lock. */
+static long long readahead_cnt;     /* Sectors queued for read-ahead. */
+static long long readahead_drop_cnt; /* Requests dropped, queue full. */
+
+/* Prints buffer cache statistics. */
+void cache_print_stats (void) {
+  long long permille = lookup_cnt ? hit_cnt * 1000 / lookup_cnt : 0;
+
+  printf ("Cache: %zu sectors, %s replacement\n",
+          cache_cnt, policy == POLICY_2Q ? "2q" : "clock");
+  printf ("Cache: %lld lookups, %lld hits (%lld.%lld%%), "
+          "%lld key comparisons\n",
+          lookup_cnt, hit_cnt, permille / 10, permille % 10, compare_cnt);
+  printf ("Cache: %lld read-aheads, %lld dropped\n",
+          readahead_cnt, readahead_drop_cnt);
+  printf ("Cache: %lld write-backs in %lld requests\n",
+          writeback_cnt, writeback_req_cnt);
+}
+
+
+/* Returns the cache block holding SECTOR, or NULL if SECTOR is
+   not cached.  If DEMAND, counts the lookup, and a hit counts as
+   a reference for the replacement policy.
+   Must be called with cache_sync held. */
+static struct cache_block* cache_search(block_sector_t sector, bool demand) {
+  struct cache_block key;
+  struct cache_block* b;
+  struct hash_elem* e;
+
+  ASSERT (lock_held_by_current_thread (&cache_sync));
+  if (demand)
+    lookup_cnt++;
+  key.sector = sector;
+  e = hash_find(&cache_index, &key.hash_elem);
+  if (e == NULL)
+    return NULL;
+  if (demand)
+    hit_cnt++;
+
+  b = hash_entry(e, struct cache_block, hash_elem);
+  if (demand && b->queue == Q_AM) {
+    list_remove(&b->queue_elem);
+    list_push_back(&am, &b->queue_elem);
+  }
+  return b;
+}
+
+/* Makes free BLOCK hold SECTOR, indexes it and queues it for the
+   replacement policy.
+   Must be called with cache_sync and BLOCK's block_lock held. */
+static void cache_install(struct cache_block* block, block_sector_t sector) {
+  ASSERT (block->sector == NULL_SECTOR);
+  ASSERT (block->queue == Q_NONE);
+  block->sector = sector;
+  block->up_to_date = false;
+  block->dirty = false;
+  block->accessed = true;
+  hash_insert(&cache_index, &block->hash_elem);
+
+  if (policy == POLICY_CLOCK)
+    block->queue = Q_CLOCK;
+  else if (ghost_remove(sector)) {
+    block->queue = Q_AM;
+    list_push_back(&am, &block->queue_elem);
+  } else {
+    block->queue = Q_A1IN;
+    list_push_back(&a1in, &block->queue_elem);
+    a1in_cnt++;
+  }
+}
+
+/* Removes BLOCK from the index and from its replacement queue,
+   leaving it on no queue.  Nobody may hold or wait for it.
+   Must be called with cache_sync and BLOCK's block_lock held. */
+static void cache_uninstall(struct cache_block* block) {
+  ASSERT (block->readers == 0 && block->read_waiters == 0);
+  ASSERT (block->writers == 0 && block->write_waiters == 0);
+  hash_delete(&cache_index, &block->hash_elem);
+
+  if (block->queue == Q_A1IN) {
+    list_remove(&block->queue_elem);
+    a1in_cnt--;
+    ghost_add(block->sector);
+  } else if (block->queue == Q_AM)
+    list_remove(&block->queue_elem);
+  block->queue = Q_NONE;
+  block->sector = NULL_SECTOR;
+}
+
+/* Returns true if anyone holds or waits for BLOCK.
+   Must be called with BLOCK's block_lock held. */
+static bool cache_busy(struct cache_block* b) {
+  return b->readers || b->writers || b->read_waiters || b->write_waiters;
+}
+
+/* Returns the first block on LIST, a 2Q queue, that nobody holds
+   or waits for, with its block_lock held, or NULL if there is none.
+   Must be called with cache_sync held. */
+static struct cache_block* first_idle(struct list* list) {
+  struct list_elem* e;
+  for (e = list_begin(list); e != list_end(list); e = list_next(e)) {
+    struct cache_block* b = list_entry(e, struct cache_block, queue_elem);
+    lock_acquire(&b->block_lock);
+    if (!cache_busy(b))
+      return b;
+    lock_release(&b->block_lock);
+  }
+  return NULL;
+}
+
+/* Runs the clock over the blocks nobody is using and returns the
+   first one not accessed since the hand last passed it, with its
+   block_lock held, or NULL if every block is in use.
+   Must be called with cache_sync held and free_blocks empty. */
+static struct cache_block* clock_victim(void) {
+  size_t i;
+  for (i = 0; i < 2 * cache_cnt; i++) {
+    struct cache_block* b = cache_block_at(hand);
+    hand = (hand + 1) % cache_cnt;
+
+    lock_acquire(&b->block_lock);
+    if (b->sector != NULL_SECTOR && !cache_busy(b)) {
+      if (!b->accessed)
+        return b;
+      b->accessed = false;
+    }
+    lock_release(&b->block_lock);
+  }
+  return NULL;
+}
+
+/* Picks a 2Q victim that nobody is using and returns it with its
+   block_lock held, or NULL if every block is in use.
+   Must be called with cache_sync held and free_blocks empty. */
+static struct cache_block* twoq_victim(void) {
+  struct cache_block* b = NULL;
+  bool tried_a1in = false;
+
+  if (a1in_cnt > cache_cnt / 4 || list_empty(&am)) {
+    b = first_idle(&a1in);
+    tried_a1in = true;
+  }
+  if (b == NULL)
+    b = first_idle(&am);
+  if (b == NULL && !tried_a1in)
+    b = first_idle(&a1in);
+  return b;
+}
+
+/* Remembers that SECTOR was just evicted from a1in, forgetting the
+   oldest such sector if a1out is full.
+   Must be called with cache_sync held. */
+static void ghost_add(block_sector_t sector) {
+  struct ghost* g;
+
+  if (a1out_cnt >= cache_cnt / 2 && a1out_cnt > 0) {
+    g = list_entry(list_pop_front(&a1out), struct ghost, list_elem);
+    hash_delete(&ghost_index, &g->hash_elem);
+    a1out_cnt--;
+    free(g);
+  }
+
+  g = malloc(sizeof *g);
+  if (g == NULL)
+    return;
+  g->sector = sector;
+  if (hash_insert(&ghost_index, &g->hash_elem) != NULL) {
+    free(g);
+    return;
+  }
+  list_push_back(&a1out, &g->list_elem);
+  a1out_cnt++;
+}
+
+/* Forgets SECTOR if it is on a1out.  Returns true if it was.
+   Must be called with cache_sync held. */
+static bool ghost_remove(block_sector_t sector) {
+  struct ghost key;
+  struct hash_elem* e;
+  struct ghost* g;
+
+  key.sector = sector;
+  e = hash_delete(&ghost_index, &key.hash_elem);
+  if (e == NULL)
+    return false;
+  g = hash_entry(e, struct ghost, hash_elem);
+  list_remove(&g->list_elem);
+  a1out_cnt--;
+  free(g);
+  return true;
+}
+
+/* Waits until BLOCK can be locked for TYPE access, then locks it.
+   Must be called with BLOCK's block_lock held. */
+static void cache_wait(struct cache_block* b, enum lock_type type) {
+  if (type == NON_EXCLUSIVE) {
+    b->read_waiters++;
+    if (b->writers || b->write_waiters)
+      do {
+        cond_wait(&b->no_writers, &b->block_lock);
+      } while (b->writers);
+    b->readers++;
+    b->read_waiters--;
+  } else {
+    b->write_waiters++;
+    if (b->readers || b->read_waiters || b->writers)
+      do {
+        cond_wait(&b->no_readers_or_writers, &b->block_lock);
+      } while (b->readers || b->writers);
+    b->writers++;
+    b->write_waiters--;
+  }
+}
+
+/* Locks the cache block for SECTOR for TYPE access, allocating
+   one if SECTOR is not cached, and returns it.  The block's data
+   is not necessarily up to date; use cache_get_data() or
+   cache_zero().  Release it with cache_unlock(). */
+struct cache_block* cache_lock(block_sector_t sector, enum lock_type type) {
+  return lock_block(sector, type, true, true);
+}
+
+/* Does the work of cache_lock().  DEMAND is false for read-ahead,
+   whose lookups are left out of the statistics.  If WAIT is false
+   and SECTOR is not cached, returns a null pointer instead of
+   waiting for a block to come free. */
+static struct cache_block* lock_block(block_sector_t sector, enum lock_type type,
+                                      bool demand, bool wait) {
+  struct cache_block* b;
+
+ try_again:
+  lock_acquire(&cache_sync);
+
+  /* Already cached? */
+  b = cache_search(sector, demand);
+  if (b != NULL) {
+    lock_acquire(&b->block_lock);
+    lock_release(&cache_sync);
+    cache_wait(b, type);
+    if (demand)
+      b->accessed = true;
+    lock_release(&b->block_lock);
+
+    /* Holding or waiting for a block pins it in the cache. */
+    ASSERT (b->sector == sector);
+    return b;
+  }
+
+  /* Not cached.  Take a free block, or else a victim chosen by
+     the replacement policy among the blocks nobody is using. */
+  if (!list_empty(&free_blocks)) {
+    b = list_entry(list_pop_front(&free_blocks), struct cache_block, queue_elem);
+    b->queue = Q_NONE;
+    lock_acquire(&b->block_lock);
+  } else {
+    b = policy == POLICY_2Q ? twoq_victim() : clock_victim();
+    if (b == NULL) {
+      /* Every block is in use.  Wait for contention to die down. */
+      lock_release(&cache_sync);
+      if (!wait)
+        return NULL;
+      timer_msleep(10);
+      goto try_again;
+    }
+
+    if (b->up_to_date && b->dirty) {
+      /* Write the victim back without holding cache_sync, then
+         start over: someone may have asked for the victim or
+         for SECTOR in the meantime.  Dirty neighbors go out in
+         the same request, since they cost next to nothing
+         extra and would otherwise need a write of their own. */
+      struct cache_block* run[CLUSTER_MAX];
+      uint8_t* staging = NULL;
+      size_t cnt, i;
+
+      b->writers = 1;
+      lock_release(&b->block_lock);
+      cnt = gather_cluster(b, run);
+      lock_release(&cache_sync);
+
+      if (cnt > 1)
+        staging = palloc_get_page(0);
+      write_cluster(run, cnt, staging);
+      palloc_free_page(staging);
+      for (i = 0; i < cnt; i++)
+        if (run[i] != b)
+          cache_unlock(run[i]);
+
+      lock_acquire(&cache_sync);
+      lock_acquire(&b->block_lock);
+      b->writers = 0;
+      if (!b->read_waiters && !b->write_waiters) {
+        cache_uninstall(b);
+        b->queue = Q_FREE;
+        list_push_back(&free_blocks, &b->queue_elem);
+      } else if (b->read_waiters)
+        cond_broadcast(&b->no_writers, &b->block_lock);
+      else
+        cond_signal(&b->no_readers_or_writers, &b->block_lock);
+      lock_release(&b->block_lock);
+      lock_release(&cache_sync);
+      goto try_again;
     }
+    cache_uninstall(b);
+  }
+
+  cache_install(b, sector);
+  if (type == NON_EXCLUSIVE)
+    b->readers = 1;
+  else
+    b->writers = 1;
+  lock_release(&b->block_lock);
+  lock_release(&cache_sync);
+  return b;
+}
 
-    hand = (hand + 1) % CACHE_CNT;
+/* Returns a pointer to BLOCK's BLOCK_SECTOR_SIZE bytes of data,
+   reading them from disk first if they are not up to date.
+   The caller must hold BLOCK locked, and may only modify the data
+   if it holds BLOCK exclusively, in which case it must also call
+   cache_dirty().  The pointer is valid until cache_unlock(). */
+void* cache_get_data(struct cache_block* b) {
+  lock_acquire(&b->data_lock);
+  if (!b->up_to_date) {
+    block_read(fs_device, b->sector, b->data);
+    b->up_to_date = true;
+    b->dirty = false;
   }
+  lock_release(&b->data_lock);
+  return b->data;
+}
 
-  struct cache_block* chosen = &cache[hand];
-  cache_write_back(chosen);
-  chosen->sector = NULL_SECTOR;
-  return chosen;
+/* Returns BLOCK's data for the caller, which must hold BLOCK
+   exclusively, to overwrite all BLOCK_SECTOR_SIZE bytes of, and
+   marks BLOCK dirty.  Does not read the sector from disk, since
+   its old contents are about to be replaced anyway. */
+void* cache_overwrite(struct cache_block* b) {
+  ASSERT (b->writers);
+  b->up_to_date = true;
+  set_dirty(b, true);
+  return b->data;
+}
+
+/* Fills BLOCK, which the caller must hold exclusively, with
+   zeros without reading it from disk, marks it dirty, and
+   returns its data. */
+void* cache_zero(struct cache_block* b) {
+  return memset(cache_overwrite(b), 0, BLOCK_SECTOR_SIZE);
+}
+
+/* Marks BLOCK, which the caller must hold exclusively and whose
+   data it has modified, as needing write-back. */
+void cache_dirty(struct cache_block* b) {
+  ASSERT (b->writers);
+  ASSERT (b->up_to_date);
+  set_dirty(b, true);
+}
+
+/* Sets BLOCK's dirty flag, keeping dirty_cnt in step.  The caller
+   must hold BLOCK locked. */
+static void set_dirty(struct cache_block* b, bool dirty) {
+  if (b->dirty == dirty)
+    return;
+  b->dirty = dirty;
+  lock_acquire(&dirty_lock);
+  dirty_cnt += dirty ? 1 : -1;
+  lock_release(&dirty_lock);
+}
+
+/* Releases the caller's lock on BLOCK. */
+void cache_unlock(struct cache_block* b) {
+  lock_acquire(&b->block_lock);
+  if (b->readers) {
+    ASSERT (b->writers == 0);
+    if (--b->readers == 0)
+      cond_signal(&b->no_readers_or_writers, &b->block_lock);
+  } else if (b->writers) {
+    ASSERT (b->readers == 0);
+    ASSERT (b->writers == 1);
+    b->writers--;
+    if (b->read_waiters)
+      cond_broadcast(&b->no_writers, &b->block_lock);
+    else
+      cond_signal(&b->no_readers_or_writers, &b->block_lock);
+  } else
+    NOT_REACHED ();
+  lock_release(&b->block_lock);
 }
 
 void cache_read (struct block* device, block_sector_t sector, void* buffer)
 {
-  lock_acquire(&cache_sync);
-  struct cache_block* buf = cache_search(sector);
-  if (buf == NULL) {
-    buf = cache_evict(sector);
-    buf->sector = sector;
-    buf->dirty = false;
-    block_read(device, sector, buf->data);
-  }
-  buf->accessed = true;
-  memcpy(buffer, buf->data, BLOCK_SECTOR_SIZE);
-  lock_release(&cache_sync);
+  ASSERT (device == fs_device);
+  struct cache_block* b = cache_lock(sector, NON_EXCLUSIVE);
+  memcpy(buffer, cache_get_data(b), BLOCK_SECTOR_SIZE);
+  cache_unlock(b);
 }
 
 void cache_write (struct block* device, block_sector_t sector, void* buffer)
 {
-  lock_acquire(&cache_sync);
-  struct cache_block* buf = cache_search(sector);
-  if (buf == NULL) {
-    buf = cache_evict(sector);
-    buf->sector = sector;
-    block_read(device, sector, buf->data);
-  }
-  buf->accessed = true;
-  buf->dirty = true;
-  memcpy (buf->data, buffer, BLOCK_SECTOR_SIZE);
-  lock_release(&cache_sync);
-}
\ No newline at end of file
+  ASSERT (device == fs_device);
+  struct cache_block* b = cache_lock(sector, EXCLUSIVE);
+  memcpy (cache_overwrite(b), buffer, BLOCK_SECTOR_SIZE);
+  cache_unlock(b);
+}
+
+/* Reads the CNT sectors starting at SECTOR, at most
+   CACHE_RUN_MAX, into BUFFER.  The blocks for all of them are
+   locked before anything is read, so that nothing can write one
+   of them between the disk read and its data being cached.  Each
+   run of them that is not up to date is then read straight into
+   BUFFER with one multi-sector request and copied into the cache
+   from there, so that read-ahead and later reads find it.  Under
+   2Q the new blocks only enter a1in, so a long sequential read
+   does not push out the blocks that are actually being reused.
+   BUFFER must be kernel memory, since it is written with the
+   blocks locked, and faulting it in could need them. */
+void cache_read_multiple (block_sector_t sector, size_t cnt, void* buffer_) {
+  uint8_t* buffer = buffer_;
+  struct cache_block* run[CACHE_RUN_MAX];
+
+  ASSERT (cnt <= CACHE_RUN_MAX);
+  ASSERT (is_kernel_vaddr (buffer));
+  while (cnt > 0) {
+    size_t locked, i, j, k;
+
+    /* Only the first block may wait for one to come free.  The
+       others are taken only if that is possible right away, so
+       that readers holding blocks cannot wait on each other. */
+    run[0] = lock_block(sector, NON_EXCLUSIVE, true, true);
+    for (locked = 1; locked < cnt; locked++) {
+      run[locked] = lock_block(sector + locked, NON_EXCLUSIVE, true, false);
+      if (run[locked] == NULL)
+        break;
+    }
+
+    for (i = 0; i < locked; i = j) {
+      j = i + 1;
+      lock_acquire(&run[i]->data_lock);
+      if (run[i]->up_to_date) {
+        memcpy(buffer + i * BLOCK_SECTOR_SIZE, run[i]->data,
+               BLOCK_SECTOR_SIZE);
+        lock_release(&run[i]->data_lock);
+        continue;
+      }
+      for (; j < locked; j++) {
+        lock_acquire(&run[j]->data_lock);
+        if (run[j]->up_to_date) {
+          lock_release(&run[j]->data_lock);
+          break;
+        }
+      }
+      block_read_multiple(fs_device, sector + i, j - i,
+                          buffer + i * BLOCK_SECTOR_SIZE);
+      for (k = i; k < j; k++) {
+        memcpy(run[k]->data, buffer + k * BLOCK_SECTOR_SIZE,
+               BLOCK_SECTOR_SIZE);
+        run[k]->up_to_date = true;
+        run[k]->dirty = false;
+        lock_release(&run[k]->data_lock);
+      }
+    }
+
+    for (i = 0; i < locked; i++)
+      cache_unlock(run[i]);
+    sector += locked;
+    buffer += locked * BLOCK_SECTOR_SIZE;
+    cnt -= locked;
+  }
+}
+
+/* Read-ahead daemon.
+
+   cache_readahead() queues a sector and returns at once; the
+   daemon then brings it into the cache in the background, so a
+   reader that asks for the sector later finds it already there
+   or already on its way in. */
+
+/* Maximum number of queued read-ahead requests.  Further
+   requests are dropped: read-ahead is only a hint. */
+#define READAHEAD_CNT 32
+
+static block_sector_t readahead_queue[READAHEAD_CNT]; /* Ring buffer. */
+static size_t readahead_head;       /* Index of oldest request. */
+static size_t readahead_len;        /* Number of queued requests. */
+static struct lock readahead_lock;  /* Protects the queue. */
+static struct condition need_readahead; /* Signaled when queue nonempty. */
+
+static void readaheadd (void *aux);
+
+/* Initializes the queue and starts the read-ahead daemon. */
+static void readaheadd_init (void) {
+  lock_init(&readahead_lock);
+  cond_init(&need_readahead);
+  if (thread_create("readaheadd", PRI_MIN, readaheadd, NULL) == NULL)
+    PANIC ("couldn't start read-ahead daemon");
+}
+
+/* Asks for SECTOR to be read into the cache in the background.
+   Never waits for disk I/O. */
+void cache_readahead (block_sector_t sector) {
+  lock_acquire(&readahead_lock);
+  if (readahead_len < READAHEAD_CNT) {
+    readahead_queue[(readahead_head + readahead_len++) % READAHEAD_CNT] = sector;
+    readahead_cnt++;
+    cond_signal(&need_readahead, &readahead_lock);
+  } else
+    readahead_drop_cnt++;
+  lock_release(&readahead_lock);
+}
+
+/* Read-ahead daemon thread. */
+static void readaheadd (void *aux UNUSED) {
+  for (;;) {
+    block_sector_t sector;
+    struct cache_block* b;
+
+    lock_acquire(&readahead_lock);
+    while (readahead_len == 0)
+      cond_wait(&need_readahead, &readahead_lock);
+    sector = readahead_queue[readahead_head];
+    readahead_head = (readahead_head + 1) % READAHEAD_CNT;
+    readahead_len--;
+    lock_release(&readahead_lock);
+
+    b = lock_block(sector, NON_EXCLUSIVE, false, true);
+    cache_get_data(b);
+    cache_unlock(b);
+  }
+}
+
+/* Write-behind daemon. */
+
+static void flushd (void *aux);
+
+/* Starts the write-behind daemon. */
+static void flushd_init (void) {
+  if (thread_create("flushd", PRI_MIN, flushd, NULL) == NULL)
+    PANIC ("couldn't start write-behind daemon");
+}
+
+/* Returns true if at least dirty_ratio percent of the cache is
+   dirty. */
+static bool too_dirty (void) {
+  bool ret;
+  lock_acquire(&dirty_lock);
+  ret = dirty_cnt * 100 >= dirty_ratio * (int) cache_cnt;
+  lock_release(&dirty_lock);
+  return ret;
+}
+
+/* Write-behind daemon thread.  Pintos has no timed waits, so it
+   polls dirty_cnt every FLUSHD_POLL_MS milliseconds in between
+   periodic flushes.  Each flush first moves the free map's
+   pending changes into the cache. */
+static void flushd (void *aux UNUSED) {
+  int waited = 0;
+  for (;;) {
+    timer_msleep(FLUSHD_POLL_MS);
+    waited += FLUSHD_POLL_MS;
+    if (waited >= flush_interval || too_dirty()) {
+      free_map_flush();
+      cache_flush();
+      waited = 0;
+    }
+  }
+}
+
+/* Orders pointers to cache blocks by sector, for qsort(). */
+static int sector_cmp (const void* a_, const void* b_) {
+  const struct cache_block* a = *(struct cache_block* const*) a_;
+  const struct cache_block* b = *(struct cache_block* const*) b_;
+  return a->sector < b->sector ? -1 : a->sector > b->sector;
+}
+
+/* Returns a hash value for the sector of a1out entry E. */
+static unsigned ghost_hash (const struct hash_elem *e, void *aux UNUSED) {
+  return hash_int(hash_entry(e, struct ghost, hash_elem)->sector);
+}
+
+/* Returns true if a1out entry A's sector precedes B's. */
+static bool ghost_less (const struct hash_elem *a, const struct hash_elem *b,
+                        void *aux UNUSED) {
+  return (hash_entry(a, struct ghost, hash_elem)->sector
+          < hash_entry(b, struct ghost, hash_elem)->sector);
+}
+
+/* Returns a hash value for the sector held by cache block E. */
+static unsigned cache_block_hash (const struct hash_elem *e, void *aux UNUSED) {
+  const struct cache_block* b = hash_entry(e, struct cache_block, hash_elem);
+  return hash_int(b->sector);
+}
+
+/* Returns true if cache block A's sector precedes B's.
+   Counts the comparison in compare_cnt. */
+static bool cache_block_less (const struct hash_elem *a_, const struct hash_elem *b_,
+                              void *aux UNUSED) {
+  const struct cache_block* a = hash_entry(a_, struct cache_block, hash_elem);
+  const struct cache_block* b = hash_entry(b_, struct cache_block, hash_elem);
+  compare_cnt++;
+  return a->sector < b->sector;
+}
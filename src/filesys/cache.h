@@ -11,11 +11,17 @@ enum lock_type
   {
     NON_EXCLUSIVE,	/* Any number of lockers. */
     EXCLUSIVE		/* Only one locker. */
-  };// This is not used. Tests can pass. Start simple and iterate upwards if needed.
+  };
 
 
+bool cache_set_policy (const char *name);
+bool cache_set_size (int cnt);
+bool cache_set_flush_interval (int interval_ms);
+bool cache_set_dirty_ratio (int ratio);
 void cache_init (void);
 void cache_flush (void);
+void cache_print_stats (void);
+void cache_readahead (block_sector_t sector);
 
 /*
 these two signatures imitate block_read, block_write and replace 
@@ -24,23 +30,24 @@ Only these two are exposed to make buffer cache more modularized.
 */
 void cache_read (struct block* device, block_sector_t sector, void* buffer);
 void cache_write (struct block* device, block_sector_t sector, void* buffer);
+void cache_read_multiple (block_sector_t sector, size_t cnt, void* buffer);
 
+/* Most sectors cache_read_multiple() reads at once. */
+#define CACHE_RUN_MAX 8
 
-//New
 /*
-struct cache_block
-{
-	struct lock block_lock;
-	struct condition no_readers_or_writers;
-	struct condition no_writers;
-	int readers, read_waiters;
-	int writers, write_waiters;
-	block_sector_t sector;
-	bool up_to_date;
-	bool dirty;
-	struct lock data_lock;
-	uint8_t data[BLOCK_SECTOR_SIZE];
-};
-programming reference
+Zero-copy access: lock the block holding a sector, work on its data
+in place, then unlock it.  Writers must hold the block EXCLUSIVE and
+call cache_dirty() (cache_overwrite() and cache_zero() do so
+themselves, and skip reading the old contents from disk).
 */
+struct cache_block;
+struct cache_block* cache_lock (block_sector_t sector, enum lock_type type);
+void* cache_get_data (struct cache_block* block);
+void* cache_overwrite (struct cache_block* block);
+void* cache_zero (struct cache_block* block);
+void cache_dirty (struct cache_block* block);
+void cache_unlock (struct cache_block* block);
+
+
 #endif /* filesys/cache.h */
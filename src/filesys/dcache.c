@@ -0,0 +1,171 @@
+#include "filesys/dcache.h"
+#include <debug.h>
+#include <hash.h>
+#include <list.h>
+#include <string.h>
+#include "filesys/directory.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
+
+/* The directory entry cache remembers the results of recent
+   lookups of a name in a directory, keyed by the directory's
+   inode sector and the name.  A positive entry records the inode
+   sector the name maps to.  A negative entry, whose sector is 0,
+   records that the directory has no such name.
+
+   directory.c consults the cache and keeps it up to date while
+   holding the directory's lock, so that a cached entry is never
+   stale: dir_add() and dir_remove() replace the entry for the
+   name they change, and removing a directory purges everything
+   cached for it. */
+
+/* Number of cached entries. */
+#define DCACHE_CNT 256
+
+/* A cached directory entry. */
+struct dentry
+  {
+    struct hash_elem hash_elem;         /* Element in dentries. */
+    struct list_elem lru_elem;          /* Element in lru. */
+    block_sector_t dir;                 /* Directory's inode sector. */
+    char name[NAME_MAX + 1];            /* Name within DIR. */
+    block_sector_t sector;              /* NAME's inode sector, or 0. */
+  };
+
+static struct dentry *dentry_pool;      /* All DCACHE_CNT entries. */
+static struct hash dentries;            /* Entries in use, by key. */
+static struct list lru;                 /* Entries, least recent first. */
+static struct lock dcache_lock;         /* Protects all of the above. */
+
+static hash_hash_func dentry_hash;
+static hash_less_func dentry_less;
+static struct dentry *find (block_sector_t dir, const char *name);
+
+/* Initializes the directory entry cache. */
+void
+dcache_init (void)
+{
+  size_t i;
+
+  dentry_pool = calloc (DCACHE_CNT, sizeof *dentry_pool);
+  if (dentry_pool == NULL)
+    PANIC ("couldn't allocate directory entry cache");
+  hash_init (&dentries, dentry_hash, dentry_less, NULL);
+  list_init (&lru);
+  lock_init (&dcache_lock);
+
+  /* Unused entries sit at the front of the LRU list, so they are
+     the first to be taken. */
+  for (i = 0; i < DCACHE_CNT; i++)
+    list_push_back (&lru, &dentry_pool[i].lru_elem);
+}
+
+/* Looks up NAME in the directory whose inode is in sector DIR.
+   If the result is cached, stores the sector of NAME's inode, or
+   0 if DIR has no entry NAME, into *SECTORP and returns true.
+   Otherwise returns false. */
+bool
+dcache_lookup (block_sector_t dir, const char *name, block_sector_t *sectorp)
+{
+  struct dentry *d;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d != NULL)
+    {
+      list_remove (&d->lru_elem);
+      list_push_back (&lru, &d->lru_elem);
+      *sectorp = d->sector;
+    }
+  lock_release (&dcache_lock);
+  return d != NULL;
+}
+
+/* Records that NAME in the directory whose inode is in sector DIR
+   refers to the inode in SECTOR, or that there is no such name if
+   SECTOR is 0, replacing whatever was cached for NAME.  Names too
+   long to be in a directory are not cached. */
+void
+dcache_insert (block_sector_t dir, const char *name, block_sector_t sector)
+{
+  struct dentry *d;
+
+  if (strlen (name) > NAME_MAX)
+    return;
+
+  lock_acquire (&dcache_lock);
+  d = find (dir, name);
+  if (d == NULL)
+    {
+      /* Recycle the least recently used entry. */
+      d = list_entry (list_front (&lru), struct dentry, lru_elem);
+      if (d->name[0] != '\0')
+        hash_delete (&dentries, &d->hash_elem);
+      d->dir = dir;
+      strlcpy (d->name, name, sizeof d->name);
+      hash_insert (&dentries, &d->hash_elem);
+    }
+  d->sector = sector;
+  list_remove (&d->lru_elem);
+  list_push_back (&lru, &d->lru_elem);
+  lock_release (&dcache_lock);
+}
+
+/* Forgets every entry cached for the directory whose inode is in
+   sector DIR, which is being removed, so that nothing stale is
+   found if the sector is reused for a new directory. */
+void
+dcache_purge (block_sector_t dir)
+{
+  size_t i;
+
+  lock_acquire (&dcache_lock);
+  for (i = 0; i < DCACHE_CNT; i++)
+    {
+      struct dentry *d = &dentry_pool[i];
+      if (d->name[0] != '\0' && d->dir == dir)
+        {
+          hash_delete (&dentries, &d->hash_elem);
+          d->name[0] = '\0';
+          list_remove (&d->lru_elem);
+          list_push_front (&lru, &d->lru_elem);
+        }
+    }
+  lock_release (&dcache_lock);
+}
+
+/* Returns the cached entry for NAME in DIR, or a null pointer if
+   there is none.  The caller must hold dcache_lock. */
+static struct dentry *
+find (block_sector_t dir, const char *name)
+{
+  struct dentry key;
+  struct hash_elem *e;
+
+  key.dir = dir;
+  if (strlcpy (key.name, name, sizeof key.name) >= sizeof key.name)
+    return NULL;
+  e = hash_find (&dentries, &key.hash_elem);
+  return e != NULL ? hash_entry (e, struct dentry, hash_elem) : NULL;
+}
+
+/* Returns a hash value for dentry E. */
+static unsigned
+dentry_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct dentry *d = hash_entry (e, struct dentry, hash_elem);
+  return hash_string (d->name) ^ hash_int (d->dir);
+}
+
+/* Returns true if dentry A's key precedes B's. */
+static bool
+dentry_less (const struct hash_elem *a_, const struct hash_elem *b_,
+             void *aux UNUSED)
+{
+  const struct dentry *a = hash_entry (a_, struct dentry, hash_elem);
+  const struct dentry *b = hash_entry (b_, struct dentry, hash_elem);
+
+  if (a->dir != b->dir)
+    return a->dir < b->dir;
+  return strcmp (a->name, b->name) < 0;
+}
@@ -1,8 +1,12 @@
 #include "filesys/directory.h"
+#include <dirent.h>
 #include <stdio.h>
 #include <string.h>
+#include <hash.h>
 #include <list.h>
+#include <round.h>
 #include "threads/thread.h"
+#include "filesys/dcache.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
 #include "threads/malloc.h"
@@ -15,16 +19,89 @@ struct dir
     uint8_t position_occupier_not_used;  /* struct dir and struct file are thus interchangeable. See sys_readdir */
   };
 
-/* A single directory entry. */
+/* A single directory entry.  On disk an entry takes rec_len bytes,
+   of which only the first ENTRY_SIZE (name_len) are in use, and
+   its name is stored without the null terminator. */
 struct dir_entry 
   {
-    block_sector_t inode_sector;        /* Sector number of header. */
-    char name[NAME_MAX + 1];            /* Null terminated file name. */
-    bool in_use;                        /* In use or free? */
+    block_sector_t inode_sector;        /* Sector number of header, 0 if free. */
+    uint16_t rec_len;                   /* Bytes from here to the next entry. */
+    uint8_t name_len;                   /* Length of name. */
+    uint8_t type;                       /* FILE_INODE or DIR_INODE. */
+    char name[NAME_MAX + 1];            /* File name, null terminated in memory. */
   };
 
+/* Bytes of an entry before its name. */
+#define ENTRY_HDR offsetof (struct dir_entry, name)
+
+/* Bytes an entry with a LEN-character name takes on disk, padded
+   so that the entry after it is aligned. */
+#define ENTRY_SIZE(LEN) ROUND_UP (ENTRY_HDR + (LEN), 4)
+
+/* A directory is a sequence of sector-sized blocks, each holding
+   entries packed one after another.  Each entry's rec_len covers
+   the free space after it up to the next entry, so the entries of
+   a block are found by following rec_len from the first one.
+   Removing an entry adds its space to the entry before it, or just
+   frees it if it is the first in the block, so free space never
+   piles up as unused slots to be scanned, and entries never move
+   while they exist.  A readdir position can still end up inside
+   an entry added since, in space freed after it was taken, so it
+   is moved up to the next entry before it is used.  An entry
+   whose rec_len is 0, such as the zeros past the end of the
+   directory, stands for free space up to the end of its block.
+
+   Block 0 starts with a struct dir_index.  A directory starts out
+   linear, with its entries in the rest of block 0, where they are
+   searched linearly.  Once block 0 is full it is converted to a
+   hashed format:
+
+   - Block 0 holds just the index.
+
+   - Blocks 1 through bucket_cnt are buckets, each of which starts
+     with a struct dir_bucket.  A name goes in the bucket its hash
+     selects or, if that one is full, in the first bucket after it
+     with room, wrapping around.  Every bucket passed over is
+     marked overflowed, so a search goes on past a bucket only if
+     it is marked.
+
+   - The number of buckets doubles whenever the table would be
+     more than 3/4 full, so that most searches read one sector. */
+#define INITIAL_BUCKETS 4
+
+/* Header of a directory, at the start of block 0. */
+struct dir_index
+  {
+    block_sector_t parent;              /* Sector of "..". */
+    uint32_t bucket_cnt;                /* Number of buckets, 0 if linear. */
+    uint32_t entry_cnt;                 /* Number of entries in use. */
+    uint32_t entry_bytes;               /* Bytes those entries use. */
+  };
+
+/* Header of a bucket of a hashed directory. */
+struct dir_bucket
+  {
+    bool overflowed;                    /* Some entry passed this bucket? */
+    uint8_t unused[3];
+  };
+
+/* Bytes for entries in a bucket, and the most entries that fit in
+   any block. */
+#define BUCKET_BYTES (BLOCK_SECTOR_SIZE - sizeof (struct dir_bucket))
+#define BLOCK_ENTRIES_MAX (BUCKET_BYTES / ENTRY_SIZE (1))
+
 static bool check_dir_empty (struct inode *inode);
-static char* strdup(const char* src);
+static bool read_index (struct inode *, struct dir_index *);
+static bool write_index (struct inode *, const struct dir_index *);
+static off_t search_block (struct inode *, size_t block, const char *name,
+                           struct dir_entry *);
+static off_t hashed_lookup (struct inode *, const struct dir_index *,
+                            const char *name, struct dir_entry *);
+static bool hashed_insert (struct inode *, const struct dir_index *,
+                           struct dir_entry *);
+static bool grow_index (struct inode *, struct dir_index *);
+static bool convert_to_hashed (struct inode *, struct dir_index *);
+static block_sector_t cached_lookup (const struct dir *, const char *name);
 
 int dir_entry_size() {
   return sizeof(struct dir_entry);
@@ -35,85 +112,135 @@ int dir_entry_size() {
 
 
 
-static char* strdup(const char* src) {
-  int length = strlen(src);
-  char* copy = malloc(sizeof (char) * (length + 1));
-  memcpy(copy, src, sizeof(char) * (length + 1));
-  return copy;
-}
+/* Extracts a file name part from *SRCP into PART, and updates
+   *SRCP so that the next call will return the next file name
+   part.  Returns 1 if successful, 0 at end of string, -1 for a
+   too-long file name part. */
+static int
+get_next_part (char part[NAME_MAX + 1], const char **srcp)
+{
+  const char *src = *srcp;
+  char *dst = part;
+
+  /* Skip leading slashes.  If it's all slashes, we're done. */
+  while (*src == '/')
+    src++;
+  if (*src == '\0')
+    return 0;
+
+  /* Copy up to NAME_MAX characters from SRC to DST.  Add null
+     terminator. */
+  while (*src != '/' && *src != '\0')
+    {
+      if (dst < part + NAME_MAX)
+        *dst++ = *src;
+      else
+        return -1;
+      src++;
+    }
+  *dst = '\0';
 
-char* pick_filename(const char* path) {
-  char* copy = strdup(path);
-  int i;
-  ASSERT(strlen(path)==strlen(copy));
-  for (i = strlen(copy); (copy[i] != '/' && i != 0) ; i--) {
-  }
-  char* name;
-  if (copy[i] != '/') {
-    name = &copy[i];
-  } else {
-    name = &copy[i+1];
-  }
-  char* ret = strdup(name);
-  free(copy);
-  return ret;
+  /* Advance source pointer. */
+  *srcp = src;
+  return 1;
 }
 
-
-char* pick_pure_directory_path(const char* path) {
-  char* copy = strdup(path);
-  int i;
-  ASSERT(strlen(path)==strlen(copy));
-  for (i = strlen(copy); (copy[i] != '/' && i != 0) ; i--) {
-  }
-
-  if (copy[i] == '/') {
-    copy[i+1] = '\0';
-  } else {
-    copy[i] = '\0';
-  }
-  char* ret = strdup(copy);
-  free(copy);
-  return ret;
+/* Replaces *INODEP, a directory, by the inode for NAME in it,
+   closing the old one.  Returns true if NAME exists and is a
+   directory.  Otherwise returns false, and the caller must still
+   close *INODEP, which may be null. */
+static bool
+descend (struct inode **inodep, const char *name)
+{
+  struct dir dir;
+  struct inode *child;
+
+  dir.inode = *inodep;
+  dir.pos = 0;
+  dir_lookup (&dir, name, &child);
+  inode_close (*inodep);
+  *inodep = child;
+  return child != NULL && inode_is_directory (child);
 }
 
+/* Walks PATH up to its last component, which it copies into NAME,
+   and returns the inode of the directory that should contain it,
+   which the caller must close.  See dir_open_parent() for
+   details.  PATH is parsed in place, one component at a time,
+   and the directories along the way are looked up without
+   opening a struct dir for each. */
+static struct inode *
+walk (const char *path, char name[NAME_MAX + 1])
+{
+  struct thread *t = thread_current ();
+  char next[NAME_MAX + 1];
+  struct inode *inode;
+  int result;
 
-// traverse the directory path one by one.
-struct dir* dir_traverse (const char *path) {
-  char* copy = strdup(path);
-  struct dir *curr;
+  if (*path == '/' || t->cwd == NULL)
+    inode = inode_open (ROOT_DIR_SECTOR);
+  else
+    inode = inode_reopen (dir_get_inode (t->cwd));
 
-  if(copy[0] == '/') {
-    curr = dir_open_root();
-  } else {
-    struct thread *t = thread_current();
-    if (t->cwd == NULL)
-      curr = dir_open_root();
-    else {
-      curr = dir_reopen( t->cwd );
+  *name = '\0';
+  while ((result = get_next_part (next, &path)) > 0)
+    {
+      if (*name != '\0' && !descend (&inode, name))
+        goto fail;
+      strlcpy (name, next, NAME_MAX + 1);
     }
-  }
+  if (result < 0)
+    goto fail;
 
-  char *token, *save_ptr;
-  for (token = strtok_r(copy, "/", &save_ptr); 
-       token != NULL;
-       token = strtok_r(NULL, "/", &save_ptr))
-  {
-    struct inode *inode = NULL;
-    if(!dir_lookup(curr, token, &inode)) goto FAIL;
-    struct dir *next = dir_open(inode);
-    dir_close(curr);
-    curr = next;
-  }
+  /* With a trailing slash, the last component is a directory that
+     stands for itself. */
+  if (*name != '\0' && *path == '/')
+    {
+      if (!descend (&inode, name))
+        goto fail;
+      *name = '\0';
+    }
+  if (inode == NULL || inode_is_removed (inode))
+    goto fail;
+  return inode;
+
+ fail:
+  inode_close (inode);
+  return NULL;
+}
 
-  if (inode_is_removed (dir_get_inode(curr))) goto FAIL;
+/* Opens the directory that contains the last component of PATH,
+   and copies that component into NAME.  PATH is relative to the
+   current thread's working directory unless it starts with "/".
+   If PATH names a directory by itself, as "/" and "a/b/" do, sets
+   NAME to the empty string and opens that directory.
+   Returns a null pointer if a directory along the way does not
+   exist, is not a directory or has been removed, or if a
+   component is longer than NAME_MAX.  The only memory allocated
+   is the returned struct dir. */
+struct dir *
+dir_open_parent (const char *path, char name[NAME_MAX + 1])
+{
+  struct inode *inode = walk (path, name);
+  return inode != NULL ? dir_open (inode) : NULL;
+}
 
-  return curr;
+/* Opens and returns the directory named by PATH, or a null
+   pointer if it does not exist, is not a directory or has been
+   removed. */
+struct dir *
+dir_traverse (const char *path)
+{
+  char name[NAME_MAX + 1];
+  struct inode *inode = walk (path, name);
 
-FAIL:
-  free(copy);
-  dir_close(curr);
-  return NULL;
+  if (inode != NULL && *name != '\0'
+      && (!descend (&inode, name) || inode_is_removed (inode)))
+    {
+      inode_close (inode);
+      inode = NULL;
+    }
+  return inode != NULL ? dir_open (inode) : NULL;
 }
 
 
@@ -121,19 +248,25 @@ FAIL:
    given SECTOR.  Returns true if successful, false on failure. */
 bool dir_create (block_sector_t sector, size_t entry_cnt)
 {
-  bool success = inode_create (sector, entry_cnt * sizeof (struct dir_entry), DIR_INODE);
-  if(!success) 
+  struct dir_index idx;
+  struct inode *inode;
+  off_t length = sizeof idx + entry_cnt * ENTRY_SIZE (NAME_MAX);
+  bool success;
+
+  if (length > BLOCK_SECTOR_SIZE)
+    length = BLOCK_SECTOR_SIZE;
+  if (!inode_create (sector, length, DIR_INODE))
     return false;
 
-// set 1st entry to be parent. Put your own inode sector here, since dir_create
-// is called during formatting. Parent of root is root itself. Reserve the space.
-  struct dir *dir = dir_open(inode_open(sector));
-  struct dir_entry e;
-  e.inode_sector = sector;
-  strlcpy (e.name, "..", sizeof e.name);
-  if (inode_write_at(dir->inode, &e, sizeof e, 0) != sizeof e) 
-    success = false;
-  dir_close (dir);
+  /* dir_create is called during formatting, so put the directory's
+     own sector as its parent: the parent of root is root itself. */
+  idx.parent = sector;
+  idx.bucket_cnt = 0;
+  idx.entry_cnt = 0;
+  idx.entry_bytes = 0;
+  inode = inode_open (sector);
+  success = inode != NULL && write_index (inode, &idx);
+  inode_close (inode);
 
   return success;
 }
@@ -200,30 +333,467 @@ dir_get_inode (struct dir *dir)
    If successful, returns true, sets *EP to the directory entry
    if EP is non-null, and sets *OFSP to the byte offset of the
    directory entry if OFSP is non-null.
-   otherwise, returns false and ignores EP and OFSP. */
+   otherwise, returns false and ignores EP and OFSP.
+   ".." is kept in the index rather than in an entry, so its
+   offset is 0.
+   The caller must hold DIR's inode locked with inode_lock(). */
 static bool
 lookup (const struct dir *dir, const char *name,
         struct dir_entry *ep, off_t *ofsp) 
 {
   struct dir_entry e;
-  size_t ofs;
+  struct dir_index idx;
+  off_t ofs;
   
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
 
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) 
-    if (e.in_use && !strcmp (name, e.name)) 
-      {
-        if (ep != NULL)
-          *ep = e;
-        if (ofsp != NULL)
-          *ofsp = ofs;
+  if (!read_index (dir->inode, &idx))
+    return false;
+  if (!strcmp (name, ".."))
+    {
+      e.inode_sector = idx.parent;
+      e.type = DIR_INODE;
+      e.name_len = strlcpy (e.name, name, sizeof e.name);
+      ofs = 0;
+    }
+  else if (idx.bucket_cnt != 0)
+    ofs = hashed_lookup (dir->inode, &idx, name, &e);
+  else
+    ofs = search_block (dir->inode, 0, name, &e);
+  if (ofs < 0)
+    return false;
+
+  if (ep != NULL)
+    *ep = e;
+  if (ofsp != NULL)
+    *ofsp = ofs;
+  return true;
+}
+
+/* Returns the byte offset in a hashed directory of bucket
+   BUCKET. */
+static off_t
+bucket_ofs (size_t bucket) 
+{
+  return (bucket + 1) * BLOCK_SECTOR_SIZE;
+}
+
+/* Returns the byte offset in a hashed directory of the
+   overflowed flag of bucket BUCKET. */
+static off_t
+overflowed_ofs (size_t bucket) 
+{
+  return bucket_ofs (bucket) + offsetof (struct dir_bucket, overflowed);
+}
+
+/* Returns the bucket that NAME hashes to in a hashed directory
+   with BUCKET_CNT buckets. */
+static size_t
+home_bucket (const char *name, size_t bucket_cnt) 
+{
+  return hash_string (name) & (bucket_cnt - 1);
+}
+
+/* Returns true if entries taking ENTRY_BYTES bytes would make a
+   hashed directory with BUCKET_CNT buckets more than 3/4 full. */
+static bool
+too_full (size_t entry_bytes, size_t bucket_cnt) 
+{
+  return entry_bytes * 4 > bucket_cnt * BUCKET_BYTES * 3;
+}
+
+/* Reads the index of directory INODE into *IDX.  Returns true if
+   successful. */
+static bool
+read_index (struct inode *inode, struct dir_index *idx) 
+{
+  return inode_read_at (inode, idx, sizeof *idx, 0) == sizeof *idx;
+}
+
+/* Writes IDX as the index of directory INODE. */
+static bool
+write_index (struct inode *inode, const struct dir_index *idx) 
+{
+  return inode_write_at (inode, idx, sizeof *idx, 0) == sizeof *idx;
+}
+
+/* Writes zeros over bytes START up to END of INODE. */
+static bool
+zero_range (struct inode *inode, off_t start, off_t end) 
+{
+  uint8_t *zeros;
+  bool success = true;
+
+  if (start >= end)
+    return true;
+  zeros = calloc (1, BLOCK_SECTOR_SIZE);
+  if (zeros == NULL)
+    return false;
+  while (start < end && success)
+    {
+      off_t chunk = end - start < BLOCK_SECTOR_SIZE ? end - start
+                                                     : BLOCK_SECTOR_SIZE;
+      success = inode_write_at (inode, zeros, chunk, start) == chunk;
+      start += chunk;
+    }
+  free (zeros);
+  return success;
+}
+
+/* Returns the byte offset of the first entry in block BLOCK. */
+static off_t
+first_entry (size_t block) 
+{
+  return (block * BLOCK_SECTOR_SIZE
+          + (block == 0 ? sizeof (struct dir_index)
+                        : sizeof (struct dir_bucket)));
+}
+
+/* Reads the entry at OFS in directory INODE into *E and returns
+   the offset of the entry after it, which is the end of the block
+   for the last entry in a block.  Anything that is not a valid
+   entry reads as free space up to the end of the block. */
+static off_t
+read_entry (struct inode *inode, off_t ofs, struct dir_entry *e) 
+{
+  off_t end = ROUND_DOWN (ofs, BLOCK_SECTOR_SIZE) + BLOCK_SECTOR_SIZE;
+  off_t size = end - ofs < (off_t) sizeof *e ? end - ofs : (off_t) sizeof *e;
+
+  if (inode_read_at (inode, e, size, ofs) < (off_t) ENTRY_HDR
+      || e->rec_len < ENTRY_HDR || e->rec_len > end - ofs
+      || e->name_len > NAME_MAX)
+    {
+      e->inode_sector = 0;
+      e->rec_len = end - ofs;
+      e->name_len = 0;
+    }
+  e->name[e->name_len] = '\0';
+  return ofs + e->rec_len;
+}
+
+/* Writes the part of E that is kept on disk at OFS in directory
+   INODE.  Returns true if successful. */
+static bool
+write_entry (struct inode *inode, off_t ofs, const struct dir_entry *e) 
+{
+  off_t size = ENTRY_HDR + e->name_len;
+  return inode_write_at (inode, e, size, ofs) == size;
+}
+
+/* Returns the number of bytes of E that are in use, which is 0 if
+   E is free. */
+static size_t
+used_bytes (const struct dir_entry *e) 
+{
+  return e->inode_sector != 0 ? ENTRY_SIZE (e->name_len) : 0;
+}
+
+/* Searches block BLOCK of directory INODE for NAME.  Returns the
+   byte offset of its entry and stores the entry in *EP, or
+   returns -1 if there is none. */
+static off_t
+search_block (struct inode *inode, size_t block, const char *name,
+              struct dir_entry *ep) 
+{
+  off_t end = (block + 1) * BLOCK_SECTOR_SIZE;
+  off_t ofs, next;
+
+  for (ofs = first_entry (block); ofs < end; ofs = next)
+    {
+      next = read_entry (inode, ofs, ep);
+      if (ep->inode_sector != 0 && !strcmp (name, ep->name))
+        return ofs;
+    }
+  return -1;
+}
+
+/* Puts E in the first free space big enough for it in block BLOCK
+   of directory INODE, splitting that space off the entry it
+   belongs to, and sets E's rec_len to match.  Returns true if
+   successful, false if the block has no room or a disk error
+   occurs. */
+static bool
+insert_in_block (struct inode *inode, size_t block, struct dir_entry *e) 
+{
+  off_t end = (block + 1) * BLOCK_SECTOR_SIZE;
+  size_t size = ENTRY_SIZE (e->name_len);
+  struct dir_entry old;
+  off_t ofs, next;
+
+  for (ofs = first_entry (block); ofs < end; ofs = next)
+    {
+      size_t used;
+
+      next = read_entry (inode, ofs, &old);
+      used = used_bytes (&old);
+      if (old.rec_len < used + size)
+        continue;
+
+      /* Write E before shrinking OLD, so that a failure in between
+         leaves E hidden in OLD's free space. */
+      e->rec_len = old.rec_len - used;
+      if (!write_entry (inode, ofs + used, e))
+        return false;
+      if (used == 0)
         return true;
-      }
+      old.rec_len = used;
+      return write_entry (inode, ofs, &old);
+    }
   return false;
 }
 
+/* Removes the entry at OFS in directory INODE, adding its space to
+   the entry before it in its block, if any.  Returns true if
+   successful, false if a disk error occurs. */
+static bool
+erase_entry (struct inode *inode, off_t ofs) 
+{
+  struct dir_entry e, prev;
+  off_t prev_ofs, next;
+
+  /* Free the entry itself first, so that a readdir position left
+     on it just skips it. */
+  read_entry (inode, ofs, &e);
+  e.inode_sector = 0;
+  if (!write_entry (inode, ofs, &e))
+    return false;
+
+  for (prev_ofs = first_entry (ofs / BLOCK_SECTOR_SIZE); prev_ofs < ofs;
+       prev_ofs = next)
+    {
+      next = read_entry (inode, prev_ofs, &prev);
+      if (next == ofs)
+        {
+          prev.rec_len += e.rec_len;
+          return write_entry (inode, prev_ofs, &prev);
+        }
+    }
+  return true;
+}
+
+/* Copies the entries in use in block BLOCK of directory INODE
+   into ENTRIES, which must have room for BLOCK_ENTRIES_MAX of
+   them, and returns how many there are.  If OFFSETS is non-null,
+   also stores the byte offset of each entry in it. */
+static size_t
+collect_block (struct inode *inode, size_t block, struct dir_entry *entries,
+               off_t *offsets) 
+{
+  off_t end = (block + 1) * BLOCK_SECTOR_SIZE;
+  off_t ofs, next;
+  size_t cnt = 0;
+
+  for (ofs = first_entry (block); ofs < end; ofs = next)
+    {
+      struct dir_entry e;
+
+      next = read_entry (inode, ofs, &e);
+      if (e.inode_sector != 0 && cnt < BLOCK_ENTRIES_MAX)
+        {
+          if (offsets != NULL)
+            offsets[cnt] = ofs;
+          entries[cnt++] = e;
+        }
+    }
+  return cnt;
+}
+
+/* Searches hashed directory INODE, whose index is IDX, for NAME.
+   Returns the byte offset of its entry and stores the entry in
+   *EP, or returns -1 if there is none. */
+static off_t
+hashed_lookup (struct inode *inode, const struct dir_index *idx,
+               const char *name, struct dir_entry *ep) 
+{
+  size_t mask = idx->bucket_cnt - 1;
+  size_t bucket = home_bucket (name, idx->bucket_cnt);
+  size_t i;
+
+  for (i = 0; i < idx->bucket_cnt; i++, bucket = (bucket + 1) & mask)
+    {
+      off_t ofs = search_block (inode, bucket + 1, name, ep);
+      bool overflowed;
+
+      if (ofs >= 0)
+        return ofs;
+      if (inode_read_at (inode, &overflowed, sizeof overflowed,
+                         overflowed_ofs (bucket)) != sizeof overflowed
+          || !overflowed)
+        break;
+    }
+  return -1;
+}
+
+/* Puts E in the first bucket of its probe sequence with room for
+   it in hashed directory INODE, whose index is IDX, marking the
+   buckets passed over as overflowed.  Does not update the entry
+   count.  Returns true if successful, false if no bucket has room
+   or a disk error occurs. */
+static bool
+hashed_insert (struct inode *inode, const struct dir_index *idx,
+               struct dir_entry *e) 
+{
+  size_t mask = idx->bucket_cnt - 1;
+  size_t bucket = home_bucket (e->name, idx->bucket_cnt);
+  const bool overflowed = true;
+  size_t i;
+
+  for (i = 0; i < idx->bucket_cnt; i++, bucket = (bucket + 1) & mask)
+    {
+      if (insert_in_block (inode, bucket + 1, e))
+        return true;
+      if (inode_write_at (inode, &overflowed, sizeof overflowed,
+                          overflowed_ofs (bucket)) != sizeof overflowed)
+        return false;
+    }
+  return false;
+}
+
+/* Marks buckets START up to END of hashed directory INODE as
+   overflowed.  Returns true if successful. */
+static bool
+mark_overflowed (struct inode *inode, size_t start, size_t end) 
+{
+  const bool overflowed = true;
+
+  for (; start < end; start++)
+    if (inode_write_at (inode, &overflowed, sizeof overflowed,
+                        overflowed_ofs (start)) != sizeof overflowed)
+      return false;
+  return true;
+}
+
+/* Clears the overflowed flag of each bucket in hashed directory
+   INODE, whose index is IDX, that no entry is probed past, using
+   ENTRIES, which must have room for BLOCK_ENTRIES_MAX entries, as
+   scratch space.  A flag that is wrongly set only costs a search
+   an extra bucket, so a failure part way through is harmless. */
+static void
+clear_overflowed (struct inode *inode, const struct dir_index *idx,
+                  struct dir_entry *entries) 
+{
+  size_t mask = idx->bucket_cnt - 1;
+  const bool overflowed = false;
+  bool *needed;
+  size_t bucket, i, cnt;
+
+  needed = calloc (idx->bucket_cnt, sizeof *needed);
+  if (needed == NULL)
+    return;
+  for (bucket = 0; bucket < idx->bucket_cnt; bucket++)
+    {
+      cnt = collect_block (inode, bucket + 1, entries, NULL);
+      for (i = 0; i < cnt; i++)
+        {
+          size_t b;
+
+          for (b = home_bucket (entries[i].name, idx->bucket_cnt);
+               b != bucket; b = (b + 1) & mask)
+            needed[b] = true;
+        }
+    }
+  for (bucket = 0; bucket < idx->bucket_cnt; bucket++)
+    if (!needed[bucket]
+        && inode_write_at (inode, &overflowed, sizeof overflowed,
+                           overflowed_ofs (bucket)) != sizeof overflowed)
+      break;
+  free (needed);
+}
+
+/* Doubles the number of buckets in hashed directory INODE, whose
+   index is *IDX, and rehashes its entries.  Returns true if
+   successful.  On failure, every entry can still be found: either
+   the directory could not be extended and keeps its old buckets,
+   or an entry could not be moved, in which case *IDX has the new
+   bucket count and every bucket stays marked overflowed. */
+static bool
+grow_index (struct inode *inode, struct dir_index *idx) 
+{
+  size_t old_cnt = idx->bucket_cnt;
+  struct dir_entry *entries;
+  off_t *offsets;
+  size_t bucket, i, cnt;
+  bool success = false;
+
+  entries = malloc (BLOCK_ENTRIES_MAX * sizeof *entries);
+  offsets = malloc (BLOCK_ENTRIES_MAX * sizeof *offsets);
+  if (entries == NULL || offsets == NULL)
+    goto done;
+
+  /* Allocate all of the new buckets up front, so that moving
+     entries into them cannot fail for lack of space.  Marking
+     every bucket overflowed makes a search visit the whole table,
+     so that an entry is found wherever it is while they move. */
+  if (!zero_range (inode, bucket_ofs (old_cnt), bucket_ofs (old_cnt * 2))
+      || !mark_overflowed (inode, 0, old_cnt * 2))
+    goto done;
+  idx->bucket_cnt = old_cnt * 2;
+  if (!write_index (inode, idx))
+    {
+      idx->bucket_cnt = old_cnt;
+      goto done;
+    }
+
+  /* Move each entry of the old buckets that is not in its home
+     bucket now.  The copy goes in before the original comes out,
+     so a failure leaves the entry where it was. */
+  for (bucket = 0; bucket < old_cnt; bucket++)
+    {
+      cnt = collect_block (inode, bucket + 1, entries, offsets);
+      for (i = 0; i < cnt; i++)
+        if (home_bucket (entries[i].name, idx->bucket_cnt) != bucket
+            && (!hashed_insert (inode, idx, &entries[i])
+                || !erase_entry (inode, offsets[i])))
+          goto done;
+    }
+  clear_overflowed (inode, idx, entries);
+  success = true;
+
+ done:
+  free (entries);
+  free (offsets);
+  return success;
+}
+
+/* Converts linear directory INODE, whose index is *IDX, to the
+   hashed format, updating *IDX.  Returns true if successful, false
+   if memory or disk space runs out, in which case INODE is left
+   as a linear directory. */
+static bool
+convert_to_hashed (struct inode *inode, struct dir_index *idx) 
+{
+  struct dir_entry *entries;
+  size_t i, cnt;
+  bool success = false;
+
+  entries = malloc (BLOCK_ENTRIES_MAX * sizeof *entries);
+  if (entries == NULL)
+    return false;
+  cnt = collect_block (inode, 0, entries, NULL);
+
+  idx->bucket_cnt = INITIAL_BUCKETS;
+  while (too_full (idx->entry_bytes, idx->bucket_cnt))
+    idx->bucket_cnt *= 2;
+
+  /* Fill in the buckets before writing the index.  Until the index
+     says the directory is hashed, the buckets are ignored and the
+     entries in block 0 are still the ones in use; after that, the
+     old entries in block 0 are ignored. */
+  if (!zero_range (inode, bucket_ofs (0), bucket_ofs (idx->bucket_cnt)))
+    goto done;
+  for (i = 0; i < cnt; i++)
+    if (!hashed_insert (inode, idx, &entries[i]))
+      goto done;
+  success = write_index (inode, idx);
+
+ done:
+  if (!success)
+    idx->bucket_cnt = 0;
+  free (entries);
+  return success;
+}
+
 
 
 
@@ -237,7 +807,7 @@ dir_lookup (const struct dir *dir,
             const char *name,
             struct inode **inode)
 {
-  struct dir_entry e;
+  block_sector_t sector;
 
   ASSERT (dir != NULL);
   ASSERT (name != NULL);
@@ -245,13 +815,36 @@ dir_lookup (const struct dir *dir,
 
   if (strcmp (name, ".") == 0) {
     *inode = inode_reopen (dir->inode);
-  } else if (lookup (dir, name, &e, NULL)) {
-    *inode = inode_open (e.inode_sector);
+  } else {
+    inode_lock (dir->inode);
+    sector = cached_lookup (dir, name);
+    if (sector != 0)
+      *inode = inode_open (sector);
+    inode_unlock (dir->inode);
   }
 
   return *inode != NULL;
 }
 
+/* Returns the sector of the inode NAME refers to in DIR, or 0 if
+   DIR has no entry NAME, going to the directory itself only if
+   the directory entry cache does not know.  The caller must hold
+   DIR's inode locked with inode_lock(). */
+static block_sector_t
+cached_lookup (const struct dir *dir, const char *name)
+{
+  block_sector_t dir_sector = inode_get_inumber (dir->inode);
+  block_sector_t sector;
+  struct dir_entry e;
+
+  if (!dcache_lookup (dir_sector, name, &sector))
+    {
+      sector = lookup (dir, name, &e, NULL) ? e.inode_sector : 0;
+      dcache_insert (dir_sector, name, sector);
+    }
+  return sector;
+}
+
 /* Adds a file named NAME to DIR, which must not already contain a
    file by that name.  The file's inode is in sector
    INODE_SECTOR.
@@ -265,7 +858,8 @@ dir_add (struct dir *dir,
          enum inode_type type)
 {
   struct dir_entry e;
-  off_t ofs;
+  struct dir_index idx;
+  size_t size;
   bool success = false;
 
   ASSERT (dir != NULL);
@@ -274,59 +868,68 @@ dir_add (struct dir *dir,
   if (*name == '\0' || strlen (name) > NAME_MAX)
     return false;
 
-  if (lookup (dir, name, NULL, NULL))
+  /* Holding DIR's lock makes the check for NAME and the addition
+     atomic, and keeps dir_remove() from removing DIR meanwhile. */
+  inode_lock (dir->inode);
+  if (inode_is_removed (dir->inode) || cached_lookup (dir, name) != 0)
     goto done;
 
-  // update the first entry of child directory to be parent
+  // set up the index of a child directory, with DIR as its parent
   if (type == DIR_INODE)
   {
-    struct dir *child_dir = dir_open( inode_open(inode_sector) );
-    if(child_dir == NULL) goto done;
-
-    e.inode_sector = inode_get_inumber( dir_get_inode(dir) );
-    strlcpy (e.name, "..", sizeof e.name);
-    if (inode_write_at(child_dir->inode, &e, sizeof e, 0) != sizeof e) {
-      dir_close (child_dir);
+    struct inode *child = inode_open (inode_sector);
+    struct dir_index child_idx;
+
+    child_idx.parent = inode_get_inumber (dir->inode);
+    child_idx.bucket_cnt = 0;
+    child_idx.entry_cnt = 0;
+    child_idx.entry_bytes = 0;
+    if (child == NULL || !write_index (child, &child_idx)) {
+      inode_close (child);
       goto done;
     }
-    dir_close (child_dir);
+    dcache_insert (inode_sector, "..", child_idx.parent);
+    inode_close (child);
   }
 
-  /* Set OFS to offset of free slot.
-     If there are no free slots, then it will be set to the
-     current end-of-file.
-
-     inode_read_at() will only return a short read at end of file.
-     Otherwise, we'd need to verify that we didn't get a short
-     read due to something intermittent such as low memory. */
-  for (ofs = 0; inode_read_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e)
-    if (!e.in_use)
-      break;
-
-  /* Write slot. */
-  e.in_use = true;
-  strlcpy (e.name, name, sizeof e.name);
+  if (!read_index (dir->inode, &idx))
+    goto done;
   e.inode_sector = inode_sector;
-  success = inode_write_at (dir->inode, &e, sizeof e, ofs) == sizeof e;
+  e.type = type;
+  e.name_len = strlcpy (e.name, name, sizeof e.name);
+  size = ENTRY_SIZE (e.name_len);
+
+  /* Add to block 0 of a linear directory, unless it is full, in
+     which case convert it.  Add to a hashed directory, growing it
+     first if it is getting full, or if no bucket has room. */
+  if (idx.bucket_cnt != 0 || !insert_in_block (dir->inode, 0, &e))
+    {
+      if (idx.bucket_cnt == 0 && !convert_to_hashed (dir->inode, &idx))
+        goto done;
+      if (too_full (idx.entry_bytes + size, idx.bucket_cnt))
+        grow_index (dir->inode, &idx);
+      if (!hashed_insert (dir->inode, &idx, &e)
+          && !(grow_index (dir->inode, &idx)
+               && hashed_insert (dir->inode, &idx, &e)))
+        goto done;
+    }
+  idx.entry_cnt++;
+  idx.entry_bytes += size;
+  success = write_index (dir->inode, &idx);
 
  done:
+  if (success)
+    dcache_insert (inode_get_inumber (dir->inode), name, inode_sector);
+  inode_unlock (dir->inode);
   return success;
 }
 
 
 
 bool check_dir_empty (struct inode *inode) {
-  struct dir_entry e;
-  off_t ofs;
+  struct dir_index idx;
 
-  for (ofs = sizeof e;
-       inode_read_at (inode, &e, sizeof e, ofs) == sizeof e;
-       ofs += sizeof e) {
-    if (e.in_use)
-      return false;
-  }
-  return true;
+  return read_index (inode, &idx) && idx.entry_cnt == 0;
 }
 
 
@@ -346,6 +949,8 @@ bool dir_remove (struct dir *dir, const char *name)
   if (!strcmp (name, ".") || !strcmp (name, ".."))
     return false;
 
+  inode_lock (dir->inode);
+
   /* Find directory entry. */
   if (!lookup (dir, name, &e, &ofs))
     goto done;
@@ -355,47 +960,151 @@ bool dir_remove (struct dir *dir, const char *name)
   if (inode == NULL)
     goto done;
 
-
-  /* Verify that it is not an in-use or non-empty directory. */
+  /* Verify that it is not an in-use or non-empty directory.
+     A directory is locked after its parent, and stays locked
+     until it is marked removed, so that dir_add() cannot put an
+     entry in it after it was found empty. */
   if (inode_is_directory(inode)) {
-    bool empty = check_dir_empty (inode);
-    if (!empty )
+    inode_lock (inode);
+    if (!check_dir_empty (inode)) {
+      inode_unlock (inode);
       goto done;
+    }
   }
 
-  /* Erase directory entry. */
-  e.in_use = false;
-  if (inode_write_at (dir->inode, &e, sizeof e, ofs) != sizeof e) 
-    goto done;
+  /* Erase directory entry, giving its space to the one before. */
+  if (erase_entry (dir->inode, ofs)) {
+    struct dir_index idx;
 
-  /* Remove inode. */
-  inode_remove (inode);
-  success = true;
+    if (read_index (dir->inode, &idx)) {
+      idx.entry_cnt--;
+      idx.entry_bytes -= ENTRY_SIZE (e.name_len);
+      write_index (dir->inode, &idx);
+    }
+
+    /* Remove inode, and forget what was cached about its entries
+       if it is a directory. */
+    dcache_insert (inode_get_inumber (dir->inode), name, 0);
+    if (inode_is_directory (inode))
+      dcache_purge (inode_get_inumber (inode));
+    inode_remove (inode);
+    success = true;
+  }
+  if (inode_is_directory(inode))
+    inode_unlock (inode);
 
  done:
+  inode_unlock (dir->inode);
   inode_close (inode);
   return success;
 }
 
+/* Moves DIR's position up to the start of the first entry in its
+   block that does not start before it.  Entries that start before
+   the position were either returned already or added since, so
+   none are missed, but an entry added since may span the
+   position, which would otherwise be read as the start of an
+   entry.  The caller must hold DIR's inode locked with
+   inode_lock(). */
+static void
+sync_pos (struct dir *dir) 
+{
+  off_t ofs = first_entry (dir->pos / BLOCK_SECTOR_SIZE);
+  struct dir_entry e;
+
+  while (ofs < dir->pos)
+    ofs = read_entry (dir->inode, ofs, &e);
+  dir->pos = ofs;
+}
+
+/* Reads the entry at DIR's position into *E and moves the position
+   past it, skipping free space and the blocks of a hashed
+   directory that hold no entries.  IDX is DIR's index.  Returns
+   false if the directory contains no more entries.  The caller
+   must hold DIR's inode locked with inode_lock(). */
+static bool
+next_entry (struct dir *dir, const struct dir_index *idx,
+            struct dir_entry *e) 
+{
+  for (;;)
+    {
+      size_t block = dir->pos / BLOCK_SECTOR_SIZE;
+
+      if (block == 0 && idx->bucket_cnt != 0)
+        block = 1;
+      if (block > idx->bucket_cnt)
+        return false;
+      if (dir->pos < first_entry (block))
+        dir->pos = first_entry (block);
+      dir->pos = read_entry (dir->inode, dir->pos, e);
+      if (e->inode_sector != 0)
+        return true;
+    }
+}
+
 /* Reads the next directory entry in DIR and stores the name in
    NAME.  Returns true if successful, false if the directory
    contains no more entries. */
 bool
 dir_readdir (struct dir *dir, char name[NAME_MAX + 1])
 {
-  //printf("enter dir_readdir\n");
   struct dir_entry e;
-
-
-  while (inode_read_at (dir->inode, &e, sizeof e, dir->pos) == sizeof e)
+  struct dir_index idx;
+  bool found = false;
+
+  /* Adding an entry to a hashed directory may rehash it and move
+     the others around. */
+  inode_lock (dir->inode);
+  sync_pos (dir);
+  if (read_index (dir->inode, &idx) && next_entry (dir, &idx, &e))
     {
-      dir->pos += sizeof e;
-      if (e.in_use && !!strcmp(e.name, ".."))
-        {
-          strlcpy (name, e.name, NAME_MAX + 1);
-          //printf("readdir_name: %s at sector %d\n", e.name, e.inode_sector);
-          return true;
-        }
+      strlcpy (name, e.name, NAME_MAX + 1);
+      found = true;
     }
-  return false;
+  inode_unlock (dir->inode);
+  return found;
+}
+
+/* Stores as many of the next entries in DIR as fit into the SIZE
+   bytes at BUF, packed as struct dirent records, taking the type
+   of each from its directory entry.  The padding in each record
+   is zeroed, since BUF is copied out to user memory.
+   Returns the number of bytes stored, 0 if the directory contains
+   no more entries, or -1 if SIZE is too small for the next one. */
+int
+dir_readdir_batch (struct dir *dir, void *buf_, size_t size)
+{
+  uint8_t *buf = buf_;
+  struct dir_entry e;
+  struct dir_index idx;
+  size_t used = 0;
+  bool full = false;
+
+  ASSERT (DIRENT_NAME_MAX == NAME_MAX);
+
+  inode_lock (dir->inode);
+  sync_pos (dir);
+  if (read_index (dir->inode, &idx))
+    for (;;)
+      {
+        off_t pos = dir->pos;
+        struct dirent *d = (struct dirent *) (buf + used);
+
+        if (!next_entry (dir, &idx, &e))
+          break;
+        if (used + DIRENT_RECLEN (e.name_len) > size)
+          {
+            dir->pos = pos;
+            full = true;
+            break;
+          }
+        memset (d, 0, DIRENT_RECLEN (e.name_len));
+        d->d_ino = e.inode_sector;
+        d->d_reclen = DIRENT_RECLEN (e.name_len);
+        d->d_type = e.type == DIR_INODE ? DT_DIR : DT_REG;
+        memcpy (d->d_name, e.name, e.name_len + 1);
+        used += d->d_reclen;
+      }
+  inode_unlock (dir->inode);
+  return used == 0 && full ? -1 : (int) used;
 }
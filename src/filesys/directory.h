@@ -17,8 +17,7 @@ struct dir;
 
 
 bool dir_create (block_sector_t sector, size_t entry_cnt);
-char* pick_filename(const char* path);
-char* pick_pure_directory_path(const char* path);
+struct dir *dir_open_parent (const char *path, char name[NAME_MAX + 1]);
 struct dir *dir_traverse (const char* path);
 struct dir *dir_open (struct inode *);
 struct dir *dir_open_root (void);
@@ -35,6 +34,7 @@ bool dir_add (struct dir *, const char *name, block_sector_t, enum inode_type ty
 
 bool dir_remove (struct dir *, const char *name);
 bool dir_readdir (struct dir *, char name[NAME_MAX + 1]);
+int dir_readdir_batch (struct dir *, void *buf, size_t size);
 
 
 int dir_entry_size(void);
@@ -8,6 +8,7 @@
 #include "filesys/inode.h"
 #include "filesys/directory.h"
 #include "filesys/cache.h"
+#include "filesys/dcache.h"
 #include "threads/malloc.h"
 
 /* Partition that contains the file system. */
@@ -25,6 +26,7 @@ filesys_init (bool format)
     PANIC ("No file system device found, can't initialize file system.");
 
   inode_init ();
+  dcache_init ();
   free_map_init ();
   cache_init();
 
@@ -52,22 +54,20 @@ bool filesys_create (const char *path,
                      enum inode_type type)
 {
   block_sector_t inode_sector = 0;
+  char filename[NAME_MAX + 1];
+  struct dir *dir = dir_open_parent (path, filename);
 
-  char* filename = pick_filename(path);
-  char* direct = pick_pure_directory_path(path);
-  struct dir* dir = dir_traverse (direct);
-  free(direct);
-
-
+  /* Put the new inode near its directory's inode. */
+  block_sector_t near = (dir != NULL
+                         ? inode_get_inumber (dir_get_inode (dir)) : 0);
   bool success = (dir != NULL
-                  && free_map_allocate (1, &inode_sector)
+                  && free_map_allocate_near (near, 1, &inode_sector)
                   && inode_create (inode_sector, initial_size, type)
                   && dir_add (dir, filename, inode_sector, type));
 
   if (!success && inode_sector != 0)
     free_map_release (inode_sector, 1);
   dir_close (dir);
-  free(filename);
 
   return success;
 }
@@ -80,35 +80,29 @@ bool filesys_create (const char *path,
 struct file *
 filesys_open (const char *name)
 {
-  int l = strlen(name);
-  if (l == 0) 
-    return NULL;
+  char filename[NAME_MAX + 1];
+  struct dir *dir;
+  struct inode *inode = NULL;
 
-  char* filename = pick_filename(name);
-  char* direct = pick_pure_directory_path(name);
-  struct dir* dir = dir_traverse (direct);
-  free(direct);
+  if (*name == '\0')
+    return NULL;
 
-  if (dir == NULL) 
-    goto FAIL;
+  dir = dir_open_parent (name, filename);
+  if (dir == NULL)
+    return NULL;
 
-  struct inode *inode = NULL;
-  if (strlen(filename) > 0) {
+  if (*filename != '\0')
     dir_lookup (dir, filename, &inode);
-    dir_close (dir);
-  } else { // dir needed
-    inode = dir_get_inode (dir);
-  }
+  else // dir needed
+    inode = inode_reopen (dir_get_inode (dir));
+  dir_close (dir);
 
   if (inode == NULL || inode_is_removed (inode))
-    goto FAIL;
-
-  free(filename);
+    {
+      inode_close (inode);
+      return NULL;
+    }
   return file_open (inode);
-
-FAIL:
-  free(filename);
-  return NULL;
 }
 
 /* Deletes the file named NAME.
@@ -118,15 +112,12 @@ FAIL:
 
 bool filesys_remove (const char *name)
 {
-  char* filename = pick_filename(name);
-  char* direct = pick_pure_directory_path(name);
-  struct dir* dir = dir_traverse (direct);
+  char filename[NAME_MAX + 1];
+  struct dir *dir = dir_open_parent (name, filename);
 
   bool success = (dir != NULL && dir_remove (dir, filename));
   dir_close (dir);
 
-  free(direct);
-  free(filename);
   return success;
 }
 
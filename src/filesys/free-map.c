@@ -1,12 +1,37 @@
 #include "filesys/free-map.h"
 #include <bitmap.h>
 #include <debug.h>
+#include <limits.h>
+#include <round.h>
 #include "filesys/file.h"
 #include "filesys/filesys.h"
 #include "filesys/inode.h"
+#include "threads/malloc.h"
+#include "threads/synch.h"
 
 static struct file *free_map_file;   /* Free map file. */
 static struct bitmap *free_map;      /* Free map, one bit per sector. */
+static struct lock free_map_lock;    /* Protects free_map and its file. */
+
+/* Changes to the free map are written to its file only by
+   free_map_flush(), and then only the sectors of the file that
+   changed.  Bit I in dirty_map is set if sector I of the free map
+   file is out of date. */
+#define BITS_PER_SECTOR (BLOCK_SECTOR_SIZE * CHAR_BIT)
+static struct bitmap *dirty_map;
+
+/* The disk is divided into allocation groups of GROUP_SECTORS
+   consecutive sectors, whose bits fill one sector of the free map
+   file.  Allocations start looking in the group of the sector
+   they want to be near and move on to the following groups,
+   skipping those that group_free says are full. */
+#define GROUP_SECTORS BITS_PER_SECTOR
+static size_t group_cnt;             /* Number of groups. */
+static size_t *group_free;           /* Free sectors in each group. */
+
+static size_t find_near (block_sector_t near, size_t cnt);
+static void count_free (void);
+static void note_change (block_sector_t, size_t cnt, bool allocated);
 
 /* Initializes the free map. */
 void
@@ -15,38 +40,215 @@ free_map_init (void)
   free_map = bitmap_create (block_size (fs_device));
   if (free_map == NULL)
     PANIC ("bitmap creation failed--file system device is too large");
+  group_cnt = DIV_ROUND_UP (bitmap_size (free_map), GROUP_SECTORS);
+  dirty_map = bitmap_create (group_cnt);
+  group_free = malloc (group_cnt * sizeof *group_free);
+  if (dirty_map == NULL || group_free == NULL)
+    PANIC ("bitmap creation failed--file system device is too large");
+  lock_init (&free_map_lock);
   bitmap_mark (free_map, FREE_MAP_SECTOR);
   bitmap_mark (free_map, ROOT_DIR_SECTOR);
+  count_free ();
 }
 
-/* Allocates CNT consecutive sectors from the free map and stores
-   the first into *SECTORP.
+/* Allocates CNT consecutive sectors as close after NEAR as they
+   fit, wrapping around to the start of the disk if need be, and
+   stores the first into *SECTORP.  Used to put an inode near its
+   directory and an indirect block near the data it maps.
    Returns true if successful, false if not enough consecutive
-   sectors were available or if the free_map file could not be
-   written. */
+   sectors were available. */
 bool
-free_map_allocate (size_t cnt, block_sector_t *sectorp)
+free_map_allocate_near (block_sector_t near, size_t cnt,
+                        block_sector_t *sectorp)
 {
-  block_sector_t sector = bitmap_scan_and_flip (free_map, 0, cnt, false);
-  if (sector != BITMAP_ERROR
-      && free_map_file != NULL
-      && !bitmap_write (free_map, free_map_file))
+  size_t sector;
+
+  lock_acquire (&free_map_lock);
+  sector = find_near (near, cnt);
+  if (sector != BITMAP_ERROR)
     {
-      bitmap_set_multiple (free_map, sector, cnt, false); 
-      sector = BITMAP_ERROR;
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      note_change (sector, cnt, true);
     }
+  lock_release (&free_map_lock);
   if (sector != BITMAP_ERROR)
     *sectorp = sector;
   return sector != BITMAP_ERROR;
 }
 
+/* Allocates a run of between 1 and CNT consecutive sectors and
+   stores the first into *SECTORP.  If HINT is free, the run
+   starts there and takes as much of CNT as is free from HINT on,
+   so that a caller passing the sector just past its previous run
+   keeps its data contiguous.  Otherwise the run is the first
+   place after HINT that CNT sectors fit, halving CNT until
+   something does.
+   Pass 0 as HINT for no preference.
+   Returns the number of sectors allocated, or 0 if the disk is
+   full. */
+size_t
+free_map_allocate_run (block_sector_t hint, size_t cnt,
+                       block_sector_t *sectorp)
+{
+  size_t size = bitmap_size (free_map);
+  size_t sector;
+
+  ASSERT (cnt > 0);
+  lock_acquire (&free_map_lock);
+  if (hint < size && !bitmap_test (free_map, hint))
+    {
+      size_t free_cnt = 1;
+
+      while (free_cnt < cnt && hint + free_cnt < size
+             && !bitmap_test (free_map, hint + free_cnt))
+        free_cnt++;
+      sector = hint;
+      cnt = free_cnt;
+    }
+  else
+    for (;;)
+      {
+        sector = find_near (hint, cnt);
+        if (sector != BITMAP_ERROR || cnt == 1)
+          break;
+        cnt /= 2;
+      }
+  if (sector != BITMAP_ERROR)
+    {
+      bitmap_set_multiple (free_map, sector, cnt, true);
+      note_change (sector, cnt, true);
+    }
+  lock_release (&free_map_lock);
+  if (sector == BITMAP_ERROR)
+    return 0;
+  *sectorp = sector;
+  return cnt;
+}
+
 /* Makes CNT sectors starting at SECTOR available for use. */
 void
 free_map_release (block_sector_t sector, size_t cnt)
 {
+  lock_acquire (&free_map_lock);
   ASSERT (bitmap_all (free_map, sector, cnt));
   bitmap_set_multiple (free_map, sector, cnt, false);
-  bitmap_write (free_map, free_map_file);
+  note_change (sector, cnt, false);
+  lock_release (&free_map_lock);
+}
+
+/* Returns the first sector of CNT consecutive free sectors that
+   starts at or after NEAR, or failing that anywhere before it,
+   or BITMAP_ERROR if there is none.  The caller must hold
+   free_map_lock. */
+static size_t
+find_near (block_sector_t near, size_t cnt)
+{
+  size_t size = bitmap_size (free_map);
+  size_t first, i;
+
+  if (near >= size)
+    near = 0;
+  first = near / GROUP_SECTORS;
+
+  /* Visit NEAR's group from NEAR on, the groups after it in turn,
+     and last the part of NEAR's group before NEAR. */
+  for (i = 0; i <= group_cnt; i++)
+    {
+      size_t group = (first + i) % group_cnt;
+      size_t start = group * GROUP_SECTORS;
+      size_t end = start + GROUP_SECTORS < size ? start + GROUP_SECTORS : size;
+      size_t sector;
+
+      if (group_free[group] == 0)
+        continue;
+      if (i == 0)
+        start = near;
+      else if (i == group_cnt)
+        end = near;
+      sector = bitmap_scan_range (free_map, start, end, cnt, false);
+      if (sector != BITMAP_ERROR)
+        return sector;
+    }
+  return BITMAP_ERROR;
+}
+
+/* Recounts the free sectors in every group. */
+static void
+count_free (void)
+{
+  size_t size = bitmap_size (free_map);
+  size_t group;
+
+  for (group = 0; group < group_cnt; group++)
+    {
+      size_t start = group * GROUP_SECTORS;
+      size_t cnt = size - start < GROUP_SECTORS ? size - start : GROUP_SECTORS;
+      group_free[group] = bitmap_count (free_map, start, cnt, false);
+    }
+}
+
+/* Notes that the CNT sectors starting at SECTOR were just
+   ALLOCATED, or released if ALLOCATED is false, updating the
+   group free counts and marking the sectors of the free map file
+   that hold their bits as dirty.  The caller must hold
+   free_map_lock. */
+static void
+note_change (block_sector_t sector, size_t cnt, bool allocated)
+{
+  size_t end = sector + cnt;
+  size_t first = sector / GROUP_SECTORS;
+  size_t last = (end - 1) / GROUP_SECTORS;
+  size_t group;
+
+  ASSERT (cnt > 0);
+  for (group = first; group <= last; group++)
+    {
+      size_t start = group * GROUP_SECTORS;
+      size_t stop = start + GROUP_SECTORS;
+      size_t n = (stop < end ? stop : end) - (start > sector ? start : sector);
+
+      if (allocated)
+        group_free[group] -= n;
+      else
+        group_free[group] += n;
+    }
+  bitmap_set_multiple (dirty_map, first, last - first + 1, true);
+}
+
+/* Writes the sectors of the free map file that are out of date,
+   coalescing adjacent ones into a single write.  Returns true if
+   successful, false if a write failed, in which case the sectors
+   not written stay dirty. */
+bool
+free_map_flush (void)
+{
+  size_t size = bitmap_size (dirty_map);
+  size_t first = 0;
+  bool success = true;
+
+  lock_acquire (&free_map_lock);
+  if (free_map_file != NULL)
+    while ((first = bitmap_scan (dirty_map, first, 1, true)) != BITMAP_ERROR)
+      {
+        size_t last = first + 1;
+        size_t start, cnt;
+
+        while (last < size && bitmap_test (dirty_map, last))
+          last++;
+        start = first * BITS_PER_SECTOR;
+        cnt = last * BITS_PER_SECTOR - start;
+        if (start + cnt > bitmap_size (free_map))
+          cnt = bitmap_size (free_map) - start;
+        if (!bitmap_write_range (free_map, free_map_file, start, cnt))
+          {
+            success = false;
+            break;
+          }
+        bitmap_set_multiple (dirty_map, first, last - first, false);
+        first = last;
+      }
+  lock_release (&free_map_lock);
+  return success;
 }
 
 /* Opens the free map file and reads it from disk. */
@@ -58,13 +260,20 @@ free_map_open (void)
     PANIC ("can't open free map");
   if (!bitmap_read (free_map, free_map_file))
     PANIC ("can't read free map");
+  bitmap_set_all (dirty_map, false);
+  count_free ();
 }
 
 /* Writes the free map to disk and closes the free map file. */
 void
 free_map_close (void) 
 {
+  if (!free_map_flush ())
+    PANIC ("can't write free map");
+  lock_acquire (&free_map_lock);
   file_close (free_map_file);
+  free_map_file = NULL;
+  lock_release (&free_map_lock);
 }
 
 /* Creates a new free map file on disk and writes the free map to
@@ -82,4 +291,5 @@ free_map_create (void)
     PANIC ("can't open free map");
   if (!bitmap_write (free_map, free_map_file))
     PANIC ("can't write free map");
+  bitmap_set_all (dirty_map, false);
 }
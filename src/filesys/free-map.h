@@ -11,7 +11,11 @@ void free_map_create (void);
 void free_map_open (void);
 void free_map_close (void);
 
-bool free_map_allocate (size_t, block_sector_t *);
+bool free_map_allocate_near (block_sector_t near, size_t cnt,
+                             block_sector_t *);
+size_t free_map_allocate_run (block_sector_t hint, size_t cnt,
+                              block_sector_t *);
 void free_map_release (block_sector_t, size_t);
+bool free_map_flush (void);
 
 #endif /* filesys/free-map.h */
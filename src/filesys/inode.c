@@ -1,4 +1,5 @@
 #include "filesys/inode.h"
+#include <hash.h>
 #include <list.h>
 #include <debug.h>
 #include <round.h>
@@ -7,10 +8,17 @@
 #include "filesys/free-map.h"
 #include "filesys/cache.h"
 #include "threads/malloc.h"
+#include "threads/palloc.h"
+#include "threads/synch.h"
+#include "threads/vaddr.h"
 
 /* Identifies an inode. */
 #define INODE_MAGIC 0x494e4f44
 
+/* Identifies an inode whose data is stored inline: in place of
+   its sector pointers, inside the inode sector itself. */
+#define INODE_MAGIC_INLINE 0x494e4c4e
+
 #define DIRECT_CNT 123
 #define INDIRECT_BLOCK_CNT 128
 
@@ -19,6 +27,13 @@
 
 #define SECTOR_CNT DIRECT_CNT + 2
 
+/* Most data sectors an inode can map. */
+#define MAX_DATA_SECTORS (DIRECT_CNT + INDIRECT_BLOCK_CNT \
+                          + INDIRECT_BLOCK_CNT * INDIRECT_BLOCK_CNT)
+
+/* Most data sectors allocate_sectors() reserves in one run. */
+#define EXTEND_RUN_MAX 256
+
 /* On-disk inode.
    Must be exactly BLOCK_SECTOR_SIZE bytes long. */
 struct inode_disk
@@ -29,6 +44,27 @@ struct inode_disk
     unsigned magic; 
   };
 
+/* Most bytes of data an inline inode can hold. */
+#define INLINE_MAX ((off_t) sizeof ((struct inode_disk *) 0)->sectors)
+
+/* Most bytes of inline data copied to or from user memory at a
+   time, through a buffer on the stack. */
+#define INLINE_CHUNK 64
+
+/* Returns true if DISK_INODE holds its data inline. */
+static inline bool
+is_inline (const struct inode_disk *disk_inode)
+{
+  return disk_inode->magic == INODE_MAGIC_INLINE;
+}
+
+/* Returns the inline data of DISK_INODE. */
+static inline uint8_t *
+inline_data (struct inode_disk *disk_inode)
+{
+  return (uint8_t *) disk_inode->sectors;
+}
+
 
 
 struct multi_index {
@@ -42,17 +78,38 @@ struct inode_indirect_block {
   block_sector_t blocks[INDIRECT_BLOCK_CNT];
 };
 
+/* Consecutive data sectors reserved by allocate_sectors() and handed
+   out one at a time, so that a file's data is laid out
+   contiguously on disk. */
+struct data_run {
+  block_sector_t next;          /* Next sector, or placement hint. */
+  size_t left;                  /* Sectors reserved from NEXT on. */
+  size_t want;                  /* Data sectors still to allocate. */
+};
+
 
 static block_sector_t index_to_sector (const struct inode_disk *idisk, off_t index);
-static block_sector_t byte_to_sector (const struct inode *inode, off_t pos);
+static block_sector_t byte_to_sector (struct inode *inode, off_t pos);
+static size_t contiguous_run (struct inode *inode, off_t pos,
+                              block_sector_t sector, size_t max);
+static block_sector_t indirect_entry (block_sector_t sector, int idx);
+static bool allocate_zeroed (block_sector_t near, block_sector_t *sectorp);
+static bool allocate_data (struct data_run *run, block_sector_t *sectorp);
 
 
 
-static bool inode_allocate (struct inode_disk *disk_inode);
-static bool inode_extend (struct inode_disk *disk_inode, off_t length);
+static bool inode_allocate (struct inode_disk *disk_inode,
+                            block_sector_t sector);
+static bool allocate_sectors (struct inode_disk *disk_inode,
+                              block_sector_t home, size_t start,
+                              size_t end);
+static block_sector_t *hold_indirect (block_sector_t sector,
+                                      struct cache_block **bp);
+static void release_indirect (struct cache_block *b, bool dirty);
 
 
 static bool inode_deallocate (struct inode *inode);
+static bool inline_to_blocks (struct inode *inode);
 void recursive_deallocate(block_sector_t sector, int level);
 
 
@@ -68,25 +125,57 @@ bytes_to_sectors (off_t size)
 /* In-memory inode. */
 struct inode
   {
-    struct list_elem elem;              /* Element in inode list. */
+    /* Protected by inode_table_lock. */
+    struct hash_elem hash_elem;         /* Element in inode_table. */
+    struct list_elem elem;              /* Element in closed_inodes. */
     block_sector_t sector;              /* Sector number of disk location. */
     int open_cnt;                       /* Number of openers. */
     bool removed;                       /* True if deleted, false otherwise. */
+
+    struct lock lock;                   /* See inode_lock(). */
+
+    /* Protected by data_lock.  The data sectors themselves are
+       protected by their cache blocks' locks, so data_lock is only
+       held to map offsets to sectors, not while copying data. */
+    struct lock data_lock;
     int deny_write_cnt;                 /* 0: writes ok, >0: deny writes. */
     struct inode_disk data;
+
+    /* Copy of the indirect block that byte_to_sector() last
+       resolved through, so that sequential access reads each
+       indirect block once rather than once per data sector.
+       MAP_FIRST is the index of the first data sector it maps,
+       or -1 if the copy is invalid. */
+    off_t map_first;
+    block_sector_t map[INDIRECT_BLOCK_CNT];
   };
 
 
 
-/* List of open inodes, so that opening a single inode twice
-   returns the same `struct inode'. */
-static struct list open_inodes;
+/* Open inodes, and recently closed ones kept for reuse, by
+   sector, so that opening a single inode twice returns the same
+   `struct inode'. */
+static struct hash inode_table;
+static struct lock inode_table_lock;
+
+/* Inodes in inode_table whose open_cnt dropped to 0, front is
+   least recently closed.  Reopening one of them needs no I/O.
+   Removed inodes are never kept. */
+#define CLOSED_INODE_MAX 32
+static struct list closed_inodes;
+static size_t closed_inode_cnt;
+
+static struct inode *inode_find (block_sector_t sector);
+static hash_hash_func inode_hash;
+static hash_less_func inode_less;
 
 /* Initializes the inode module. */
 void
 inode_init (void)
 {
-  list_init (&open_inodes);
+  hash_init (&inode_table, inode_hash, inode_less, NULL);
+  list_init (&closed_inodes);
+  lock_init (&inode_table_lock);
 }
 
 /* Initializes an inode with LENGTH bytes of data and
@@ -112,8 +201,13 @@ inode_create (block_sector_t sector, off_t length, enum inode_type type)
       disk_inode->length = length;
       disk_inode->magic = INODE_MAGIC;
       disk_inode->type = type;
-      memset(disk_inode->sectors, 0, SECTOR_CNT);
-      if (inode_allocate (disk_inode))
+
+      /* A small enough file starts out inline, so reading it
+         takes no I/O beyond the inode sector.  Its data is
+         already zeroed by calloc(). */
+      if (length <= INLINE_MAX)
+        disk_inode->magic = INODE_MAGIC_INLINE;
+      if (is_inline (disk_inode) || inode_allocate (disk_inode, sector))
         {
           cache_write (fs_device, sector, disk_inode);
           success = true;
@@ -128,34 +222,69 @@ inode_create (block_sector_t sector, off_t length, enum inode_type type)
    Returns a null pointer if memory allocation fails. */
 struct inode * inode_open (block_sector_t sector)
 {
-  struct list_elem *e;
-  struct inode *inode;
+  struct inode *inode, *other;
 
-  /* Check whether this inode is already open. */
-  for (e = list_begin (&open_inodes); e != list_end (&open_inodes);
-       e = list_next (e))
-    {
-      inode = list_entry (e, struct inode, elem);
-      if (inode->sector == sector)
-        {
-          inode_reopen (inode);
-          return inode;
-        }
-    }
+  /* Check whether this inode is already open, or was closed
+     recently enough to still be around. */
+  lock_acquire (&inode_table_lock);
+  inode = inode_find (sector);
+  lock_release (&inode_table_lock);
+  if (inode != NULL)
+    return inode;
 
   /* Allocate memory. */
   inode = malloc (sizeof *inode);
   if (inode == NULL)
     return NULL;
 
-  /* Initialize. */
-  list_push_front (&open_inodes, &inode->elem);
+  /* Initialize.  The sector is read without holding
+     inode_table_lock, so another thread may open the same inode
+     meanwhile, in which case its copy wins. */
   inode->sector = sector;
   inode->open_cnt = 1;
-  inode->deny_write_cnt = 0;
   inode->removed = false;
-
+  lock_init (&inode->lock);
+  lock_init (&inode->data_lock);
+  inode->deny_write_cnt = 0;
+  inode->map_first = -1;
   cache_read (fs_device, inode->sector, &inode->data);
+
+  lock_acquire (&inode_table_lock);
+  other = inode_find (sector);
+  if (other == NULL)
+    hash_insert (&inode_table, &inode->hash_elem);
+  lock_release (&inode_table_lock);
+  if (other != NULL)
+    {
+      free (inode);
+      inode = other;
+    }
+  return inode;
+}
+
+/* Returns the inode for SECTOR in inode_table, reopened, or a
+   null pointer if there is none.
+   Must be called with inode_table_lock held. */
+static struct inode *
+inode_find (block_sector_t sector)
+{
+  struct inode key;
+  struct hash_elem *e;
+  struct inode *inode;
+
+  ASSERT (lock_held_by_current_thread (&inode_table_lock));
+  key.sector = sector;
+  e = hash_find (&inode_table, &key.hash_elem);
+  if (e == NULL)
+    return NULL;
+
+  inode = hash_entry (e, struct inode, hash_elem);
+  if (inode->open_cnt == 0)
+    {
+      list_remove (&inode->elem);
+      closed_inode_cnt--;
+    }
+  inode->open_cnt++;
   return inode;
 }
 
@@ -164,7 +293,11 @@ struct inode *
 inode_reopen (struct inode *inode)
 {
   if (inode != NULL)
-    inode->open_cnt++;
+    {
+      lock_acquire (&inode_table_lock);
+      inode->open_cnt++;
+      lock_release (&inode_table_lock);
+    }
   return inode;
 }
 
@@ -175,31 +308,50 @@ inode_get_inumber (const struct inode *inode)
   return inode->sector;
 }
 
-/* Closes INODE and writes it to disk.
-   If this was the last reference to INODE, frees its memory.
-   If INODE was also a removed inode, frees its blocks. */
+/* Closes INODE.  Its contents are always up to date on disk (or
+   in the buffer cache), so nothing needs to be written.
+   If this was the last reference to INODE, keeps it on
+   closed_inodes for a quick reopen, freeing the least recently
+   closed inode if there are too many.
+   If INODE was also a removed inode, frees its memory and its
+   blocks at once. */
 void
 inode_close (struct inode *inode)
 {
+  struct inode *old = NULL;
+
   /* Ignore null pointer. */
   if (inode == NULL)
     return;
 
   /* Release resources if this was the last opener. */
+  lock_acquire (&inode_table_lock);
   if (--inode->open_cnt == 0)
     {
-      /* Remove from inode list and release lock. */
-      list_remove (&inode->elem);
-
-      /* Deallocate blocks if removed. */
+      /* Deallocate blocks if removed.  Nobody else can find the
+         inode once it is out of inode_table, so that is done
+         without holding inode_table_lock. */
       if (inode->removed)
         {
+          hash_delete (&inode_table, &inode->hash_elem);
+          lock_release (&inode_table_lock);
           free_map_release (inode->sector, 1);
           inode_deallocate (inode);
+          free (inode);
+          return;
         }
 
-      free (inode);
+      list_push_back (&closed_inodes, &inode->elem);
+      if (++closed_inode_cnt > CLOSED_INODE_MAX)
+        {
+          old = list_entry (list_pop_front (&closed_inodes),
+                            struct inode, elem);
+          closed_inode_cnt--;
+          hash_delete (&inode_table, &old->hash_elem);
+        }
     }
+  lock_release (&inode_table_lock);
+  free (old);
 }
 
 /* Marks INODE to be deleted when it is closed by the last caller who
@@ -208,7 +360,9 @@ void
 inode_remove (struct inode *inode)
 {
   ASSERT (inode != NULL);
+  lock_acquire (&inode_table_lock);
   inode->removed = true;
+  lock_release (&inode_table_lock);
 }
 
 /* Reads SIZE bytes from INODE into BUFFER, starting at position OFFSET.
@@ -218,42 +372,121 @@ off_t
 inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
 {
   uint8_t *buffer = buffer_;
-  off_t bytes_read = 0;
   uint8_t *bounce = NULL;
+  off_t bytes_read = 0;
+
+  /* Inline data is copied straight into a kernel buffer.  A user
+   buffer is filled through STAGED, a piece at a time, because
+   faulting it in might need data_lock.  If a write moves the data
+   out to a sector meanwhile, the rest is read from there. */
+  lock_acquire (&inode->data_lock);
+  while (is_inline (&inode->data))
+    {
+      uint8_t staged[INLINE_CHUNK];
+      off_t chunk_size = inode->data.length - offset;
+
+      if (chunk_size > size)
+        chunk_size = size;
+      if (chunk_size <= 0)
+        {
+          lock_release (&inode->data_lock);
+          return bytes_read;
+        }
+      if (is_kernel_vaddr (buffer))
+        {
+          memcpy (buffer + bytes_read, inline_data (&inode->data) + offset,
+                  chunk_size);
+          lock_release (&inode->data_lock);
+          return bytes_read + chunk_size;
+        }
+      if (chunk_size > (off_t) sizeof staged)
+        chunk_size = sizeof staged;
+      memcpy (staged, inline_data (&inode->data) + offset, chunk_size);
+      lock_release (&inode->data_lock);
+      memcpy (buffer + bytes_read, staged, chunk_size);
+
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_read += chunk_size;
+      lock_acquire (&inode->data_lock);
+    }
+  lock_release (&inode->data_lock);
+
+  /* A user buffer is filled through BOUNCE, because faulting it in
+     with a cache block locked might need that same block, as when
+     it is a mapping of this file. */
+  if (size > 0 && !is_kernel_vaddr (buffer))
+    {
+      bounce = palloc_get_page (0);
+      if (bounce == NULL)
+        return bytes_read;
+    }
 
   while (size > 0)
     {
-      /* Disk sector to read, starting byte offset within sector. */
-      block_sector_t sector_idx = byte_to_sector (inode, offset);
+      uint8_t *dst = bounce != NULL ? bounce : buffer + bytes_read;
+      block_sector_t sector_idx, next = 0;
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      struct cache_block *b;
+      off_t inode_left;
+      int sector_left, min_left, chunk_size;
+      size_t run = 1;
+
+      lock_acquire (&inode->data_lock);
+
+      /* Disk sector to read. */
+      sector_idx = byte_to_sector (inode, offset);
 
       /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
-      int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      inode_left = inode->data.length - offset;
+      sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
+      min_left = inode_left < sector_left ? inode_left : sector_left;
 
       /* Number of bytes to actually copy out of this sector. */
-      int chunk_size = size < min_left ? size : min_left;
+      chunk_size = size < min_left ? size : min_left;
+
+      /* A whole sector may start a run of sectors that also lie
+         one after another on disk, to be read in one request. */
+      if (sector_idx != 0 && chunk_size == BLOCK_SECTOR_SIZE)
+        {
+          off_t left = size < inode_left ? size : inode_left;
+          run = contiguous_run (inode, offset, sector_idx,
+                                left / BLOCK_SECTOR_SIZE);
+          chunk_size = run * BLOCK_SECTOR_SIZE;
+        }
+      /* A read that stops partway through a sector will go on in
+         the same sector, so only read ahead once this one is
+         used up. */
+      if (chunk_size > 0 && sector_ofs + chunk_size >= BLOCK_SECTOR_SIZE
+          && offset + chunk_size < inode->data.length)
+        next = byte_to_sector (inode, offset + chunk_size);
+      lock_release (&inode->data_lock);
       if (chunk_size <= 0)
         break;
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      /* Start fetching the next sector so that its disk I/O
+         overlaps with copying this one. */
+      if (next != 0)
+        cache_readahead (next);
+
+      if (sector_idx == 0)
         {
-          /* Read full sector directly into caller's buffer. */
-          cache_read (fs_device, sector_idx, buffer + bytes_read);
+          /* A hole, which reads as zeros without any I/O. */
+          memset (buffer + bytes_read, 0, chunk_size);
         }
       else
         {
-          /* Read sector into bounce buffer, then partially copy
-             into caller's buffer. */
-          if (bounce == NULL)
+          if (run > 1)
+            cache_read_multiple (sector_idx, run, dst);
+          else
             {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
+              /* Copy out of the cached sector in place. */
+              b = cache_lock (sector_idx, NON_EXCLUSIVE);
+              memcpy (dst, cache_get_data (b) + sector_ofs, chunk_size);
+              cache_unlock (b);
             }
-          cache_read (fs_device, sector_idx, bounce);
-          memcpy (buffer + bytes_read, bounce + sector_ofs, chunk_size);
+          if (bounce != NULL)
+            memcpy (buffer + bytes_read, bounce, chunk_size);
         }
 
       /* Advance. */
@@ -261,85 +494,162 @@ inode_read_at (struct inode *inode, void *buffer_, off_t size, off_t offset)
       offset += chunk_size;
       bytes_read += chunk_size;
     }
-  free (bounce);
+  palloc_free_page (bounce);
 
   return bytes_read;
 }
 
 /* Writes SIZE bytes from BUFFER into INODE, starting at OFFSET.
    Returns the number of bytes actually written, which may be
-   less than SIZE if end of file is reached or an error occurs.
-   (Normally a write at end of file would extend the inode).
-   */
+   less than SIZE if the disk fills up or an error occurs.
+   A write past end of file extends the inode.  Only the sectors
+   actually written are allocated, so any gap between the old end
+   of file and OFFSET is left as a hole. */
 off_t
 inode_write_at (struct inode *inode, const void *buffer_, off_t size,
                 off_t offset)
 {
   const uint8_t *buffer = buffer_;
-  off_t bytes_written = 0;
   uint8_t *bounce = NULL;
+  off_t bytes_written = 0;
+  bool inode_dirty = false;
+  bool fits_inline = offset <= INLINE_MAX && size <= INLINE_MAX - offset;
 
+  lock_acquire (&inode->data_lock);
   if (inode->deny_write_cnt)
-    return 0;
+    {
+      lock_release (&inode->data_lock);
+      return 0;
+    }
 
-  // exceed file bound
-  if( byte_to_sector(inode, offset + size - 1) == -1u) {
-    bool success;
-    success = inode_extend (& inode->data, offset + size);
-    if (!success) return 0;
-    inode->data.length = offset + size;
-    cache_write (fs_device, inode->sector, & inode->data);
-  }
+  /* A write that stays within INLINE_MAX goes into the inline data,
+     straight from a kernel buffer.  A user buffer is copied in
+     through STAGED, a piece at a time, with data_lock released,
+     because faulting it in might need data_lock.  If another write
+     moves the data out to a sector meanwhile, the rest goes
+     there. */
+  while (fits_inline && size > 0 && is_inline (&inode->data))
+    {
+      uint8_t staged[INLINE_CHUNK];
+      const uint8_t *src = buffer + bytes_written;
+      off_t chunk_size = size;
+
+      if (!is_kernel_vaddr (buffer))
+        {
+          if (chunk_size > (off_t) sizeof staged)
+            chunk_size = sizeof staged;
+          lock_release (&inode->data_lock);
+          memcpy (staged, src, chunk_size);
+          lock_acquire (&inode->data_lock);
+          if (!is_inline (&inode->data))
+            break;
+          src = staged;
+        }
+      memcpy (inline_data (&inode->data) + offset, src, chunk_size);
+      if (offset + chunk_size > inode->data.length)
+        inode->data.length = offset + chunk_size;
+      inode_dirty = true;
+
+      size -= chunk_size;
+      offset += chunk_size;
+      bytes_written += chunk_size;
+    }
+
+  if (size > 0 && is_inline (&inode->data)
+      && (offset / BLOCK_SECTOR_SIZE >= MAX_DATA_SECTORS
+          || !inline_to_blocks (inode)))
+    {
+      lock_release (&inode->data_lock);
+      return 0;
+    }
+
+  /* A user buffer is copied in through BOUNCE before locking each
+     cache block, because faulting it in with the block locked
+     might need that same block, as when it is a mapping of this
+     file. */
+  if (size > 0 && !is_kernel_vaddr (buffer))
+    {
+      bounce = palloc_get_page (0);
+      if (bounce == NULL)
+        size = 0;
+    }
 
   while (size > 0)
     {
       /* Sector to write, starting byte offset within sector. */
       block_sector_t sector_idx = byte_to_sector (inode, offset);
       int sector_ofs = offset % BLOCK_SECTOR_SIZE;
+      const uint8_t *src = buffer + bytes_written;
+      struct cache_block *b;
 
-      /* Bytes left in inode, bytes left in sector, lesser of the two. */
-      off_t inode_left = inode_length (inode) - offset;
+      /* Number of bytes to actually write into this sector. */
       int sector_left = BLOCK_SECTOR_SIZE - sector_ofs;
-      int min_left = inode_left < sector_left ? inode_left : sector_left;
+      int chunk_size = size < sector_left ? size : sector_left;
 
-      /* Number of bytes to actually write into this sector. */
-      int chunk_size = size < min_left ? size : min_left;
-      if (chunk_size <= 0)
-        break;
+      if (sector_idx == 0)
+        {
+          /* A hole or past the end of the inode's sectors.
+             Allocate every unallocated sector the rest of this
+             write covers at once, so they can be laid out
+             together. */
+          size_t first = offset / BLOCK_SECTOR_SIZE;
+          size_t end = bytes_to_sectors (offset + size);
+          bool success;
+
+          if (first >= MAX_DATA_SECTORS)
+            break;
+          if (end > MAX_DATA_SECTORS)
+            end = MAX_DATA_SECTORS;
+          success = allocate_sectors (&inode->data, inode->sector,
+                                      first, end);
+
+          inode->map_first = -1;
+          inode_dirty = true;
+          sector_idx = byte_to_sector (inode, offset);
+          if (!success && sector_idx == 0)
+            break;
+        }
 
-      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+      lock_release (&inode->data_lock);
+      if (bounce != NULL)
         {
-          /* Write full sector directly to disk. */
-          cache_write (fs_device, sector_idx, buffer + bytes_written);
+          memcpy (bounce, src, chunk_size);
+          src = bounce;
         }
+
+      /* Copy straight into the cached sector.  A full sector is
+         installed without reading the old contents; a partial one
+         is read, modified and written.  Dirty sectors are written
+         back later, with consecutive ones clustered together. */
+      b = cache_lock (sector_idx, EXCLUSIVE);
+      if (sector_ofs == 0 && chunk_size == BLOCK_SECTOR_SIZE)
+        memcpy (cache_overwrite (b), src, BLOCK_SECTOR_SIZE);
       else
         {
-          /* We need a bounce buffer. */
-          if (bounce == NULL)
-            {
-              bounce = malloc (BLOCK_SECTOR_SIZE);
-              if (bounce == NULL)
-                break;
-            }
-
-          /* If the sector contains data before or after the chunk
-             we're writing, then we need to read in the sector
-             first.  Otherwise we start with a sector of all zeros. */
-          if (sector_ofs > 0 || chunk_size < sector_left)
-            cache_read (fs_device, sector_idx, bounce);
-          else
-            memset (bounce, 0, BLOCK_SECTOR_SIZE);
-          memcpy (bounce + sector_ofs, buffer + bytes_written, chunk_size);
-          cache_write (fs_device, sector_idx, bounce);
+          memcpy (cache_get_data (b) + sector_ofs, src, chunk_size);
+          cache_dirty (b);
         }
+      cache_unlock (b);
 
       /* Advance. */
       size -= chunk_size;
       offset += chunk_size;
       bytes_written += chunk_size;
+      lock_acquire (&inode->data_lock);
     }
-  free (bounce);
 
+  /* The new length is only published once the data is in place,
+     so a reader never sees the end of the file before its
+     contents, and only as far as data was actually written. */
+  if (bytes_written > 0 && offset > inode->data.length)
+    {
+      inode->data.length = offset;
+      inode_dirty = true;
+    }
+  if (inode_dirty)
+    cache_write (fs_device, inode->sector, &inode->data);
+  lock_release (&inode->data_lock);
+  palloc_free_page (bounce);
   return bytes_written;
 }
 
@@ -348,8 +658,10 @@ inode_write_at (struct inode *inode, const void *buffer_, off_t size,
 void
 inode_deny_write (struct inode *inode)
 {
+  lock_acquire (&inode->data_lock);
   inode->deny_write_cnt++;
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
+  lock_release (&inode->data_lock);
 }
 
 /* Re-enables writes to INODE.
@@ -363,17 +675,38 @@ inode_allow_write (struct inode *inode)
   if (!(inode->deny_write_cnt <= inode->open_cnt)) {
     printf("inode->deny_write_cnt is %d, inode->open_cnt is %d\n", inode->deny_write_cnt, inode->open_cnt);
   }
+  lock_acquire (&inode->data_lock);
   ASSERT (inode->deny_write_cnt <= inode->open_cnt);
   inode->deny_write_cnt--;
+  lock_release (&inode->data_lock);
 }
 
-/* Returns the length, in bytes, of INODE's data. */
+/* Returns the length, in bytes, of INODE's data.  Without
+   data_lock this is only a snapshot, but reading one aligned word
+   is atomic, so it is always a length INODE really had. */
 off_t
 inode_length (const struct inode *inode)
 {
   return inode->data.length;
 }
 
+/* Locks INODE for a caller that must make several accesses to it
+   atomically, such as the directory code updating entries.  This
+   is independent of the locking inode_read_at() and
+   inode_write_at() do internally, so the holder may call them. */
+void
+inode_lock (struct inode *inode)
+{
+  lock_acquire (&inode->lock);
+}
+
+/* Releases INODE locked by inode_lock(). */
+void
+inode_unlock (struct inode *inode)
+{
+  lock_release (&inode->lock);
+}
+
 /* Returns whether the file is directory or not. */
 bool
 inode_is_directory (const struct inode *inode)
@@ -389,9 +722,10 @@ inode_is_removed (const struct inode *inode)
 }
 
 static
-bool inode_allocate (struct inode_disk *disk_inode)
+bool inode_allocate (struct inode_disk *disk_inode, block_sector_t sector)
 {
-  return inode_extend (disk_inode, disk_inode->length);
+  return allocate_sectors (disk_inode, sector, 0,
+                           bytes_to_sectors (disk_inode->length));
 }
 
 
@@ -431,90 +765,249 @@ static struct multi_index calculate_indices(off_t sector_index) {
 
 
 
-static block_sector_t byte_to_sector (const struct inode *inode, off_t pos) {
+/* Returns the disk sector holding data sector INDEX of IDISK,
+   reading the indirect blocks it goes through from the cache,
+   or 0 if that sector has not been allocated. */
+static block_sector_t index_to_sector (const struct inode_disk *idisk,
+                                       off_t index) {
+  struct multi_index mult = calculate_indices(index);
+  block_sector_t ret = idisk->sectors[mult.level_one];
+
+  if (mult.level_two == -1 || ret == 0) return ret;
+  ret = indirect_entry(ret, mult.level_two);
+  if (mult.level_three == -1 || ret == 0) return ret;
+  return indirect_entry(ret, mult.level_three);
+}
+
+/* Returns the disk sector holding byte offset POS of INODE, or 0
+   if that part of INODE is a hole or lies past its allocated
+   sectors.  Sector 0 holds the free map's inode, so it is never
+   a data sector.  Sectors reached through an indirect block are
+   looked up in INODE's copy of it, which is refreshed from the
+   cache only when POS moves to a different indirect block. */
+static block_sector_t byte_to_sector (struct inode *inode, off_t pos) {
   ASSERT (inode != NULL);
-  if (!(0 <= pos && pos < inode->data.length))
-    return -1;
+  ASSERT (pos >= 0);
 
   off_t index = pos / BLOCK_SECTOR_SIZE;
-  struct inode_disk* idisk = &inode->data;
+  const struct inode_disk* idisk = &inode->data;
+  if (index >= MAX_DATA_SECTORS)
+    return 0;
 
-  block_sector_t ret;
-  struct inode_indirect_block indirect_block;
   struct multi_index mult = calculate_indices(index);
+  int leaf_idx;
 
   ASSERT(mult.level_one != -1);
-  ret = idisk->sectors[mult.level_one];
-  if (mult.level_two == -1) return ret;
+  if (mult.level_two == -1) return idisk->sectors[mult.level_one];
+
+  leaf_idx = mult.level_three == -1 ? mult.level_two : mult.level_three;
+  if (inode->map_first != index - leaf_idx) {
+    block_sector_t leaf = idisk->sectors[mult.level_one];
+    struct cache_block *b;
+
+    if (mult.level_three != -1 && leaf != 0)
+      leaf = indirect_entry(leaf, mult.level_two);
+    if (leaf != 0) {
+      b = cache_lock (leaf, NON_EXCLUSIVE);
+      memcpy (inode->map, cache_get_data (b), sizeof inode->map);
+      cache_unlock (b);
+    } else
+      memset (inode->map, 0, sizeof inode->map);
+    inode->map_first = index - leaf_idx;
+  }
+  return inode->map[leaf_idx];
+}
 
-  cache_read(fs_device, ret, &indirect_block);
-  ret = indirect_block.blocks[mult.level_two];
-  if (mult.level_three == -1) return ret;
+/* Returns how many data sectors of INODE, starting with the one
+   at byte offset POS whose disk sector is SECTOR, lie in
+   consecutive disk sectors, counting at most MAX (and at most
+   CACHE_RUN_MAX).  Must be called with INODE's data_lock held. */
+static size_t contiguous_run (struct inode *inode, off_t pos,
+                              block_sector_t sector, size_t max) {
+  size_t cnt = 1;
+
+  if (max > CACHE_RUN_MAX)
+    max = CACHE_RUN_MAX;
+  while (cnt < max
+         && byte_to_sector (inode, pos + cnt * BLOCK_SECTOR_SIZE)
+            == sector + cnt)
+    cnt++;
+  return cnt;
+}
 
-  cache_read(fs_device, ret, &indirect_block);
-  ret = indirect_block.blocks[mult.level_three];
+/* Returns entry IDX of the indirect block in SECTOR, reading it
+   in place in the cache. */
+static block_sector_t indirect_entry (block_sector_t sector, int idx) {
+  struct cache_block *b = cache_lock (sector, NON_EXCLUSIVE);
+  struct inode_indirect_block *indirect = cache_get_data (b);
+  block_sector_t ret = indirect->blocks[idx];
+  cache_unlock (b);
   return ret;
 }
 
-/* Note: this function extends the inode UP TO the length, NOT by the length */
-static bool inode_extend (struct inode_disk *disk_inode, off_t length) {
-  static char zeros[BLOCK_SECTOR_SIZE];
-  struct inode_indirect_block indirect_block;
-  block_sector_t* block = indirect_block.blocks;
+/* Allocates a sector as close after NEAR as possible, zeroes it
+   in the cache without reading it from disk, and stores its
+   number in *SECTORP. */
+static bool allocate_zeroed (block_sector_t near, block_sector_t *sectorp) {
+  struct cache_block *b;
+
+  if (!free_map_allocate_near (near, 1, sectorp))
+    return false;
+  b = cache_lock (*sectorp, EXCLUSIVE);
+  cache_zero (b);
+  cache_unlock (b);
+  return true;
+}
+
+/* Allocates the next data sector of RUN, reserving a new run of
+   up to RUN->want sectors if RUN is used up, zeroes it in the
+   cache and stores its number in *SECTORP. */
+static bool allocate_data (struct data_run *run, block_sector_t *sectorp) {
+  struct cache_block *b;
+
+  if (run->left == 0) {
+    size_t cnt = run->want < EXTEND_RUN_MAX ? run->want : EXTEND_RUN_MAX;
+    run->left = free_map_allocate_run (run->next, cnt, &run->next);
+    if (run->left == 0)
+      return false;
+  }
+  *sectorp = run->next++;
+  run->left--;
+  run->want--;
 
-  block_sector_t* sectors = disk_inode->sectors;
+  b = cache_lock (*sectorp, EXCLUSIVE);
+  cache_zero (b);
+  cache_unlock (b);
+  return true;
+}
+
+/* Locks indirect block SECTOR exclusively in the cache, stores it
+   into *BP and returns its entries, which the caller may update
+   until release_indirect(). */
+static block_sector_t *hold_indirect (block_sector_t sector,
+                                      struct cache_block **bp) {
+  struct inode_indirect_block *indirect;
+
+  *bp = cache_lock (sector, EXCLUSIVE);
+  indirect = cache_get_data (*bp);
+  return indirect->blocks;
+}
 
-  size_t num_sectors = bytes_to_sectors(length);
-  unsigned int i;
+/* Releases indirect block B held by hold_indirect(), marking it
+   for write-back if DIRTY.  Does nothing if B is null. */
+static void release_indirect (struct cache_block *b, bool dirty) {
+  if (b == NULL)
+    return;
+  if (dirty)
+    cache_dirty (b);
+  cache_unlock (b);
+}
+
+/* Allocates each of data sectors START up to END of DISK_INODE
+   that is not allocated yet, along with the indirect blocks they
+   need.  Each indirect block is held in the cache while its
+   entries are filled in and dirtied once, rather than locked
+   again for every entry.
+   New data sectors are taken from runs of consecutive free
+   sectors, each starting right after the file's last data sector
+   if that is free, so that the file stays contiguous on disk.
+   The first data sector, and any that follow a hole, go as close
+   after HOME, the sector of the inode itself, as they fit.
+   Indirect blocks go right where the data they map is heading. */
+static bool allocate_sectors (struct inode_disk *disk_inode,
+                              block_sector_t home, size_t start,
+                              size_t num_sectors) {
+  block_sector_t* sectors = disk_inode->sectors;
+  size_t i;
   struct multi_index mult;
+  struct data_run run = { 0, 0, 0 };
 
-  for (i=0; i < num_sectors; i++) {
-    mult = calculate_indices(i);
+  /* The double indirect block and the indirect block of data
+     sectors being filled in, if any, and whether they changed. */
+  struct cache_block *outer = NULL, *leaf = NULL;
+  block_sector_t *outer_ptrs = NULL, *leaf_ptrs = NULL;
+  bool outer_dirty = false, leaf_dirty = false;
+  bool success = true;
 
-    if (sectors[mult.level_one] == 0) {
-      if (!free_map_allocate (1, &sectors[mult.level_one])) 
-        return false;
-      cache_write(fs_device, sectors[mult.level_one], zeros);
+  if (start >= num_sectors)
+    return true;
+  run.want = num_sectors - start;
+  run.next = start > 0 ? index_to_sector (disk_inode, start - 1) : 0;
+  run.next = (run.next != 0 ? run.next : home) + 1;
+
+  for (i = start; i < num_sectors && success; i++) {
+    int leaf_idx;
+
+    mult = calculate_indices(i);
+    if (mult.level_two == -1) {
+      if (sectors[mult.level_one] == 0)
+        success = allocate_data (&run, &sectors[mult.level_one]);
+      continue;
     }
-    if (mult.level_two == -1) continue;
 
-    cache_read(fs_device, sectors[mult.level_one], &indirect_block);
-    if (block[mult.level_two] == 0) {
-      if (!free_map_allocate (1, &block[mult.level_two])) return false;
-      cache_write(fs_device, block[mult.level_two], zeros);
-      cache_write(fs_device, sectors[mult.level_one], &indirect_block);
+    leaf_idx = mult.level_three == -1 ? mult.level_two : mult.level_three;
+    if (leaf == NULL || leaf_idx == 0) {
+      block_sector_t *slot;
+
+      release_indirect (leaf, leaf_dirty);
+      leaf = NULL;
+      leaf_dirty = false;
+
+      if (mult.level_three == -1)
+        slot = &sectors[mult.level_one];
+      else {
+        if (outer == NULL) {
+          if (sectors[mult.level_one] == 0
+              && !allocate_zeroed (run.next, &sectors[mult.level_one])) {
+            success = false;
+            break;
+          }
+          outer_ptrs = hold_indirect (sectors[mult.level_one], &outer);
+        }
+        slot = &outer_ptrs[mult.level_two];
+        if (*slot == 0)
+          outer_dirty = true;
+      }
+      if (*slot == 0 && !allocate_zeroed (run.next, slot)) {
+        success = false;
+        break;
+      }
+      leaf_ptrs = hold_indirect (*slot, &leaf);
     }
-    if (mult.level_three == -1) continue;
-
-    block_sector_t origin = block[mult.level_two];
-    cache_read(fs_device, origin, &indirect_block);
-    if (block[mult.level_three] == 0) {
-      if (!free_map_allocate (1, &block[mult.level_three])) return false;
-      cache_write(fs_device, block[mult.level_three], zeros);
-      cache_write(fs_device, origin, &indirect_block);
+
+    if (leaf_ptrs[leaf_idx] == 0) {
+      success = allocate_data (&run, &leaf_ptrs[leaf_idx]);
+      leaf_dirty = true;
     }
   }
-  return true;
+  release_indirect (leaf, leaf_dirty);
+  release_indirect (outer, outer_dirty);
+
+  /* Give back whatever part of the last run went unused. */
+  if (run.left > 0)
+    free_map_release (run.next, run.left);
+  return success;
 }
 
 
 void recursive_deallocate(block_sector_t sector, int level) {
   if (sector == 0) return;
 
-  if (level == 0) {
-    free_map_release(sector, 1);
-  } else {
-    struct inode_indirect_block indirect_block;
+  if (level > 0) {
+    struct cache_block *b = cache_lock (sector, NON_EXCLUSIVE);
+    struct inode_indirect_block *indirect = cache_get_data (b);
     size_t i;
-    cache_read(fs_device, sector, &indirect_block);
     for (i=0; i< INDIRECT_BLOCK_CNT; i++)
-      recursive_deallocate(indirect_block.blocks[i], level-1);
-    free_map_release(sector, 1);
+      recursive_deallocate(indirect->blocks[i], level-1);
+    cache_unlock (b);
   }
+  free_map_release(sector, 1);
 }
 
 static bool inode_deallocate (struct inode *inode) {
   if(inode->data.length < 0) return false;
+  inode->map_first = -1;
+  if (is_inline (&inode->data)) return true;
 
   block_sector_t* sectors = inode->data.sectors;
   size_t i;
@@ -523,4 +1016,67 @@ static bool inode_deallocate (struct inode *inode) {
   recursive_deallocate(sectors[SINGLE_INDIRECT_INDEX], 1);
   recursive_deallocate(sectors[DOUBLE_INDIRECT_INDEX], 2);
   return true;
-}
\ No newline at end of file
+}
+
+/* Returns a hash value for inode E. */
+static unsigned
+inode_hash (const struct hash_elem *e, void *aux UNUSED)
+{
+  const struct inode *inode = hash_entry (e, struct inode, hash_elem);
+  return hash_int (inode->sector);
+}
+
+/* Returns true if inode A precedes inode B. */
+static bool
+inode_less (const struct hash_elem *a_, const struct hash_elem *b_,
+            void *aux UNUSED)
+{
+  const struct inode *a = hash_entry (a_, struct inode, hash_elem);
+  const struct inode *b = hash_entry (b_, struct inode, hash_elem);
+  return a->sector < b->sector;
+}
+
+/* Moves the inline data of INODE into a data sector, switching
+   INODE to the block-mapped format, because a write is about to
+   grow it past INLINE_MAX.  Leaves INODE inline and returns false
+   if the disk or memory is full.
+   Must be called with INODE's data_lock held. */
+static bool
+inline_to_blocks (struct inode *inode)
+{
+  struct inode_disk *disk_inode = &inode->data;
+  off_t length = disk_inode->length;
+  uint8_t *copy = malloc (INLINE_MAX);
+  struct cache_block *b;
+
+  /* INLINE_MAX is less than a sector, so one sector will do. */
+  ASSERT (INLINE_MAX <= BLOCK_SECTOR_SIZE);
+  if (copy == NULL)
+    return false;
+  memcpy (copy, inline_data (disk_inode), INLINE_MAX);
+  memset (disk_inode->sectors, 0, sizeof disk_inode->sectors);
+  disk_inode->magic = INODE_MAGIC;
+
+  if (length > 0)
+    {
+      if (!allocate_sectors (disk_inode, inode->sector, 0, 1))
+        {
+          memcpy (inline_data (disk_inode), copy, INLINE_MAX);
+          disk_inode->magic = INODE_MAGIC_INLINE;
+          free (copy);
+          return false;
+        }
+
+      /* The new sector was zeroed in the cache, so only the
+         inline bytes need copying over. */
+      b = cache_lock (disk_inode->sectors[0], EXCLUSIVE);
+      memcpy (cache_get_data (b), copy, length);
+      cache_dirty (b);
+      cache_unlock (b);
+    }
+  free (copy);
+
+  inode->map_first = -1;
+  cache_write (fs_device, inode->sector, disk_inode);
+  return true;
+}
@@ -36,8 +36,8 @@ off_t inode_length (const struct inode *);
 
 //int inode_open_cnt(const struct inode *);
 
-//void inode_lock(struct inode *);
-//void inode_unlock(struct inode *);
+void inode_lock (struct inode *);
+void inode_unlock (struct inode *);
 
 bool inode_is_removed (const struct inode* inode);
 bool inode_is_directory (const struct inode* inode);
@@ -0,0 +1,43 @@
+#ifndef __LIB_DIRENT_H
+#define __LIB_DIRENT_H
+
+/* Directory entries as returned by the getdents system call,
+   shared by the kernel and user programs. */
+
+#include <round.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Type of the file a directory entry names. */
+enum dirent_type
+  {
+    DT_REG = 1,                 /* Ordinary file. */
+    DT_DIR = 2                  /* Directory. */
+  };
+
+/* A directory entry.  getdents() packs as many of these into the
+   caller's buffer as fit, each d_reclen bytes long, so that the
+   next one starts at (char *) d + d->d_reclen. */
+struct dirent
+  {
+    uint32_t d_ino;             /* Inode number. */
+    uint16_t d_reclen;          /* Length of this record in bytes. */
+    uint8_t d_type;             /* A dirent_type. */
+    char d_name[];              /* Null-terminated file name. */
+  };
+
+/* Length of the record for a name of LEN characters, padded so
+   that the record after it is aligned. */
+#define DIRENT_RECLEN(LEN) \
+        ROUND_UP (offsetof (struct dirent, d_name) + (LEN) + 1, \
+                  sizeof (uint32_t))
+
+/* Longest name in a directory entry.  Must match NAME_MAX in
+   filesys/directory.h. */
+#define DIRENT_NAME_MAX 14
+
+/* Length of the longest record.  A buffer at least this big
+   always has room for the next entry. */
+#define DIRENT_MAX DIRENT_RECLEN (DIRENT_NAME_MAX)
+
+#endif /* lib/dirent.h */
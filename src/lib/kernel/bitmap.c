@@ -28,6 +28,7 @@ struct bitmap
   {
     size_t bit_cnt;     /* Number of bits. */
     elem_type *bits;    /* Elements that represent bits. */
+    size_t hint;        /* Where bitmap_scan_and_flip() resumes. */
   };
 
 /* Returns the index of the element that contains the bit
@@ -68,6 +69,38 @@ last_mask (const struct bitmap *b)
   int last_bits = b->bit_cnt % ELEM_BITS;
   return last_bits ? ((elem_type) 1 << last_bits) - 1 : (elem_type) -1;
 }
+
+/* Returns the index of the first bit in B at or after START,
+   and before END, that is set to VALUE, or END if there is no
+   such bit.  Examines a whole element at a time, using the
+   processor's bit scan instruction to locate the bit within an
+   element. */
+static size_t
+find_next (const struct bitmap *b, size_t start, size_t end, bool value)
+{
+  elem_type flip = value ? 0 : (elem_type) -1;
+  size_t idx, last_idx;
+  elem_type word;
+
+  if (start >= end)
+    return end;
+
+  /* Invert the element if we are looking for a 0 bit, so that
+     either way we are looking for the lowest 1 bit, and ignore
+     the bits below START. */
+  idx = elem_idx (start);
+  last_idx = elem_idx (end - 1);
+  word = (b->bits[idx] ^ flip) & ((elem_type) -1 << (start % ELEM_BITS));
+  while (word == 0)
+    {
+      if (++idx > last_idx)
+        return end;
+      word = b->bits[idx] ^ flip;
+    }
+
+  start = idx * ELEM_BITS + __builtin_ctzl (word);
+  return start < end ? start : end;
+}
 
 /* Creation and destruction. */
 
@@ -83,6 +116,7 @@ bitmap_create (size_t bit_cnt)
     {
       b->bit_cnt = bit_cnt;
       b->bits = malloc (byte_cnt (bit_cnt));
+      b->hint = 0;
       if (b->bits != NULL || bit_cnt == 0)
         {
           bitmap_set_all (b, false);
@@ -105,6 +139,7 @@ bitmap_create_in_buf (size_t bit_cnt, void *block, size_t block_size UNUSED)
 
   b->bit_cnt = bit_cnt;
   b->bits = (elem_type *) (b + 1);
+  b->hint = 0;
   bitmap_set_all (b, false);
   return b;
 }
@@ -250,16 +285,11 @@ bitmap_count (const struct bitmap *b, size_t start, size_t cnt, bool value)
 bool
 bitmap_contains (const struct bitmap *b, size_t start, size_t cnt, bool value) 
 {
-  size_t i;
-  
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
   ASSERT (start + cnt <= b->bit_cnt);
 
-  for (i = 0; i < cnt; i++)
-    if (bitmap_test (b, start + i) == value)
-      return true;
-  return false;
+  return find_next (b, start, start + cnt, value) < start + cnt;
 }
 
 /* Returns true if any bits in B between START and START + CNT,
@@ -298,30 +328,76 @@ bitmap_scan (const struct bitmap *b, size_t start, size_t cnt, bool value)
   ASSERT (b != NULL);
   ASSERT (start <= b->bit_cnt);
 
-  if (cnt <= b->bit_cnt) 
+  if (cnt == 0)
+    return start;
+  return bitmap_scan_range (b, start, b->bit_cnt, cnt, value);
+}
+
+/* Finds and returns the starting index of the first group of CNT
+   consecutive bits in B that are all set to VALUE and that starts
+   at or after START and before END.  The group may extend past
+   END.
+   If there is no such group, returns BITMAP_ERROR. */
+size_t
+bitmap_scan_range (const struct bitmap *b, size_t start, size_t end,
+                   size_t cnt, bool value) 
+{
+  size_t i;
+
+  ASSERT (b != NULL);
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (end <= b->bit_cnt);
+
+  if (cnt == 0)
+    return start < end ? start : BITMAP_ERROR;
+
+  /* Skip to the next bit set to VALUE, then measure the run that
+     starts there.  A run that is too short is skipped as a
+     whole, so each element is examined about once. */
+  i = start;
+  while (i < end && cnt <= b->bit_cnt - i)
     {
-      size_t last = b->bit_cnt - cnt;
-      size_t i;
-      for (i = start; i <= last; i++)
-        if (!bitmap_contains (b, i, cnt, !value))
-          return i; 
+      size_t run_end;
+
+      i = find_next (b, i, end, value);
+      if (i >= end || cnt > b->bit_cnt - i)
+        break;
+      run_end = find_next (b, i, i + cnt, !value);
+      if (run_end == i + cnt)
+        return i;
+      i = run_end;
     }
   return BITMAP_ERROR;
 }
 
-/* Finds the first group of CNT consecutive bits in B at or after
-   START that are all set to VALUE, flips them all to !VALUE,
-   and returns the index of the first bit in the group.
+/* Finds a group of CNT consecutive bits in B at or after START
+   that are all set to VALUE, flips them all to !VALUE, and
+   returns the index of the first bit in the group.
    If there is no such group, returns BITMAP_ERROR.
-   If CNT is zero, returns 0.
+   If CNT is zero, returns START.
+
+   The search is next-fit: it resumes just past the group found
+   by the previous call, wrapping around to START, so that
+   repeated allocations from a nearly full bitmap do not rescan
+   the full prefix every time.  Thus, the group returned is not
+   necessarily the first one at or after START.
+
    Bits are set atomically, but testing bits is not atomic with
    setting them. */
 size_t
 bitmap_scan_and_flip (struct bitmap *b, size_t start, size_t cnt, bool value)
 {
-  size_t idx = bitmap_scan (b, start, cnt, value);
+  size_t idx = BITMAP_ERROR;
+
+  if (cnt > 0 && b->hint > start && b->hint < b->bit_cnt)
+    idx = bitmap_scan (b, b->hint, cnt, value);
+  if (idx == BITMAP_ERROR)
+    idx = bitmap_scan (b, start, cnt, value);
   if (idx != BITMAP_ERROR) 
-    bitmap_set_multiple (b, idx, cnt, !value);
+    {
+      bitmap_set_multiple (b, idx, cnt, !value);
+      b->hint = idx + cnt;
+    }
   return idx;
 }
 
@@ -358,6 +434,28 @@ bitmap_write (const struct bitmap *b, struct file *file)
   off_t size = byte_cnt (b->bit_cnt);
   return file_write_at (file, b->bits, size, 0) == size;
 }
+
+/* Writes the part of B that holds the CNT bits starting at START
+   to the same position in FILE, rounded out to whole elements.
+   Return true if successful, false otherwise. */
+bool
+bitmap_write_range (const struct bitmap *b, struct file *file,
+                    size_t start, size_t cnt)
+{
+  size_t first, last;
+  off_t ofs, size;
+
+  ASSERT (start <= b->bit_cnt);
+  ASSERT (start + cnt <= b->bit_cnt);
+  if (cnt == 0)
+    return true;
+
+  first = elem_idx (start);
+  last = elem_idx (start + cnt - 1);
+  ofs = first * sizeof (elem_type);
+  size = (last - first + 1) * sizeof (elem_type);
+  return file_write_at (file, b->bits + first, size, ofs) == size;
+}
 #endif /* FILESYS */
 
 /* Debugging. */
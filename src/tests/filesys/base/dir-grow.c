@@ -0,0 +1,62 @@
+/* Creates enough files in the root directory to make its hash
+   table grow twice, then checks that each of them can still be
+   opened and that getdents() lists every one exactly once. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 300
+
+static bool seen[FILE_CNT];
+
+void
+test_main (void) 
+{
+  char buf[512];
+  char name[32];
+  int fd, n, i;
+
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "file-%03d", i);
+      CHECK (create (name, 0), "create \"%s\"", name);
+    }
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      snprintf (name, sizeof name, "file-%03d", i);
+      CHECK ((fd = open (name)) > 1, "open \"%s\"", name);
+      close (fd);
+    }
+  quiet = false;
+  msg ("created %d files", FILE_CNT);
+
+  CHECK ((fd = open ("/")) > 1, "open \"/\"");
+  while ((n = getdents (fd, (struct dirent *) buf, sizeof buf)) > 0) 
+    {
+      int ofs;
+
+      for (ofs = 0; ofs < n; ofs += ((struct dirent *) (buf + ofs))->d_reclen)
+        {
+          struct dirent *d = (struct dirent *) (buf + ofs);
+
+          if (memcmp (d->d_name, "file-", 5))
+            continue;
+          i = atoi (d->d_name + 5);
+          if (i < 0 || i >= FILE_CNT || seen[i])
+            fail ("unexpected or repeated entry \"%s\"", d->d_name);
+          seen[i] = true;
+        }
+    }
+  if (n != 0)
+    fail ("getdents returned %d", n);
+  for (i = 0; i < FILE_CNT; i++)
+    if (!seen[i])
+      fail ("\"file-%03d\" not listed", i);
+  msg ("listed %d files", FILE_CNT);
+  close (fd);
+}
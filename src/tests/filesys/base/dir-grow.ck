@@ -0,0 +1,12 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(dir-grow) begin
+(dir-grow) created 300 files
+(dir-grow) open "/"
+(dir-grow) listed 300 files
+(dir-grow) end
+EOF
+pass;
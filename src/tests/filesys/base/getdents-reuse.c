@@ -0,0 +1,64 @@
+/* Lists the root directory with getdents() one entry at a time.
+   Partway through, removes the entry after the last one listed
+   and creates one with a longer name, which takes over the space
+   freed in front of the listing position and spans it.  Checks
+   that the entries after it are still listed. */
+
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Reads the next entry in directory FD into NAME, with a buffer
+   too small for two entries.  Returns false at the end of the
+   directory. */
+static bool
+next_name (int fd, char name[DIRENT_NAME_MAX + 1]) 
+{
+  char buf[DIRENT_MAX];
+  int n = getdents (fd, (struct dirent *) buf, sizeof buf);
+
+  if (n < 0)
+    fail ("getdents returned %d", n);
+  if (n == 0)
+    return false;
+  strlcpy (name, ((struct dirent *) buf)->d_name, DIRENT_NAME_MAX + 1);
+  return true;
+}
+
+void
+test_main (void) 
+{
+  char name[DIRENT_NAME_MAX + 1];
+  bool seen_d = false, seen_e = false;
+  int fd;
+
+  CHECK (create ("aaaaaa", 0), "create \"aaaaaa\"");
+  CHECK (create ("bbbbbb", 0), "create \"bbbbbb\"");
+  CHECK (create ("cccccc", 0), "create \"cccccc\"");
+  CHECK (create ("dddddd", 0), "create \"dddddd\"");
+  CHECK (create ("eeeeee", 0), "create \"eeeeee\"");
+  CHECK (remove ("bbbbbb"), "remove \"bbbbbb\"");
+  CHECK ((fd = open ("/")) > 1, "open \"/\"");
+
+  do
+    if (!next_name (fd, name))
+      fail ("\"aaaaaa\" not listed");
+  while (strcmp (name, "aaaaaa"));
+  msg ("listed \"aaaaaa\"");
+
+  CHECK (remove ("cccccc"), "remove \"cccccc\"");
+  CHECK (create ("xxxxxxxxxxxxxx", 0), "create \"xxxxxxxxxxxxxx\"");
+
+  while (next_name (fd, name))
+    {
+      if (!strcmp (name, "bbbbbb") || !strcmp (name, "cccccc"))
+        fail ("removed \"%s\" listed", name);
+      seen_d |= !strcmp (name, "dddddd");
+      seen_e |= !strcmp (name, "eeeeee");
+    }
+  if (!seen_d || !seen_e)
+    fail ("\"%s\" not listed", seen_d ? "eeeeee" : "dddddd");
+  msg ("listed \"dddddd\" and \"eeeeee\"");
+  close (fd);
+}
@@ -0,0 +1,20 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(getdents-reuse) begin
+(getdents-reuse) create "aaaaaa"
+(getdents-reuse) create "bbbbbb"
+(getdents-reuse) create "cccccc"
+(getdents-reuse) create "dddddd"
+(getdents-reuse) create "eeeeee"
+(getdents-reuse) remove "bbbbbb"
+(getdents-reuse) open "/"
+(getdents-reuse) listed "aaaaaa"
+(getdents-reuse) remove "cccccc"
+(getdents-reuse) create "xxxxxxxxxxxxxx"
+(getdents-reuse) listed "dddddd" and "eeeeee"
+(getdents-reuse) end
+EOF
+pass;
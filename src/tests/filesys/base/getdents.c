@@ -0,0 +1,64 @@
+/* Creates enough files to make the root directory hashed, then
+   lists it with getdents() and checks that every file comes back
+   exactly once, as an ordinary file, in a few calls. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+#define FILE_CNT 50
+
+void
+test_main (void) 
+{
+  bool seen[FILE_CNT];
+  char buf[512];
+  int fd, n, i;
+  int calls = 0;
+
+  quiet = true;
+  for (i = 0; i < FILE_CNT; i++) 
+    {
+      char name[16];
+
+      snprintf (name, sizeof name, "gd-%d", i);
+      CHECK (create (name, 0), "create \"%s\"", name);
+      seen[i] = false;
+    }
+  CHECK ((fd = open ("/")) > 1, "open \"/\"");
+
+  CHECK (getdents (fd, (struct dirent *) buf, 4) == -1,
+         "getdents with a 4-byte buffer (must fail)");
+  while ((n = getdents (fd, (struct dirent *) buf, sizeof buf)) > 0) 
+    {
+      int ofs;
+
+      calls++;
+      for (ofs = 0; ofs < n; ofs += ((struct dirent *) (buf + ofs))->d_reclen)
+        {
+          struct dirent *d = (struct dirent *) (buf + ofs);
+
+          if (memcmp (d->d_name, "gd-", 3))
+            continue;
+          i = atoi (d->d_name + 3);
+          if (i < 0 || i >= FILE_CNT || seen[i])
+            fail ("unexpected or repeated entry \"%s\"", d->d_name);
+          if (d->d_type != DT_REG)
+            fail ("\"%s\" has type %d", d->d_name, d->d_type);
+          seen[i] = true;
+        }
+    }
+  quiet = false;
+  if (n != 0)
+    fail ("getdents returned %d", n);
+  for (i = 0; i < FILE_CNT; i++)
+    if (!seen[i])
+      fail ("\"gd-%d\" not listed", i);
+  if (calls > 4)
+    fail ("listing took %d calls", calls);
+  msg ("listed %d files", FILE_CNT);
+  close (fd);
+}
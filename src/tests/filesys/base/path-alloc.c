@@ -0,0 +1,42 @@
+/* Makes a chain of nested directories and looks up a missing file
+   at the bottom of it many times, keeping every directory along
+   the way open so that its inode stays in memory.  Each lookup
+   should then allocate only the struct dir it opens, however deep
+   the path.  path-alloc.ck checks the kernel's count of
+   allocations, printed at shutdown, against that. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+/* Number of lookups.  Must match path-alloc.ck. */
+#define LOOKUPS 2000
+
+/* Directories, outermost first. */
+static const char *dirs[] = 
+  {
+    "/a", "/a/b", "/a/b/c", "/a/b/c/d", "/a/b/c/d/e", "/a/b/c/d/e/f",
+  };
+#define DIR_CNT (sizeof dirs / sizeof *dirs)
+
+void
+test_main (void) 
+{
+  const char *file_name = "/a/b/c/d/e/f/missing";
+  int fds[DIR_CNT];
+  size_t i;
+
+  for (i = 0; i < DIR_CNT; i++)
+    {
+      CHECK (mkdir (dirs[i]), "mkdir \"%s\"", dirs[i]);
+      CHECK ((fds[i] = open (dirs[i])) > 1, "open \"%s\"", dirs[i]);
+    }
+
+  msg ("remove \"%s\" %d times", file_name, LOOKUPS);
+  for (i = 0; i < LOOKUPS; i++)
+    if (remove (file_name))
+      fail ("remove \"%s\" succeeded", file_name);
+
+  for (i = 0; i < DIR_CNT; i++)
+    close (fds[i]);
+}
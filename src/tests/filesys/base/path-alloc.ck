@@ -0,0 +1,36 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+our ($test);
+
+my (@output) = read_text_file ("$test.output");
+common_checks ("run", @output);
+compare_output ("run", IGNORE_EXIT_CODES => 1, \@output, [<<'EOF']);
+(path-alloc) begin
+(path-alloc) mkdir "/a"
+(path-alloc) open "/a"
+(path-alloc) mkdir "/a/b"
+(path-alloc) open "/a/b"
+(path-alloc) mkdir "/a/b/c"
+(path-alloc) open "/a/b/c"
+(path-alloc) mkdir "/a/b/c/d"
+(path-alloc) open "/a/b/c/d"
+(path-alloc) mkdir "/a/b/c/d/e"
+(path-alloc) open "/a/b/c/d/e"
+(path-alloc) mkdir "/a/b/c/d/e/f"
+(path-alloc) open "/a/b/c/d/e/f"
+(path-alloc) remove "/a/b/c/d/e/f/missing" 2000 times
+(path-alloc) end
+EOF
+
+# Each lookup allocates the one struct dir it opens.  The count at
+# shutdown covers the whole run, so allow as much again for booting
+# and loading the test, which is still far short of the seven
+# allocations per lookup of a walk that allocates per component.
+my ($lookups) = 2000;
+my ($allocs) = map (/^Malloc: (\d+) allocations$/, @output);
+fail "No \"Malloc: # allocations\" message\n" if !defined $allocs;
+fail "$allocs kernel allocations for $lookups lookups\n"
+  if $allocs > 2 * $lookups;
+pass;
@@ -0,0 +1,25 @@
+/* Writes to a file at an offset beyond the largest possible file
+   size, which must fail without changing the file's size. */
+
+#include <syscall.h>
+#include "tests/lib.h"
+#include "tests/main.h"
+
+void
+test_main (void) 
+{
+  const char *file_name = "past-max";
+  static const char data[] = "0123456789";
+  int fd;
+
+  CHECK (create (file_name, 0), "create \"%s\"", file_name);
+  CHECK ((fd = open (file_name)) > 1, "open \"%s\"", file_name);
+  CHECK (write (fd, data, sizeof data) == sizeof data,
+         "write %zu bytes", sizeof data);
+  seek (fd, 64 * 1024 * 1024);
+  CHECK (write (fd, data, sizeof data) == 0,
+         "write past the maximum file size (must write nothing)");
+  CHECK (filesize (fd) == sizeof data, "verify size is still %zu",
+         sizeof data);
+  close (fd);
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+check_expected (IGNORE_EXIT_CODES => 1, [<<'EOF']);
+(write-past-max) begin
+(write-past-max) create "past-max"
+(write-past-max) open "past-max"
+(write-past-max) write 11 bytes
+(write-past-max) write past the maximum file size (must write nothing)
+(write-past-max) verify size is still 11
+(write-past-max) end
+EOF
+pass;
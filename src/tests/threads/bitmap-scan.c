@@ -0,0 +1,112 @@
+/* Allocates single bits and a short run from a large, nearly
+   full bitmap, the way the free map, the page allocator, and
+   the swap allocator do, and checks that each allocation lands
+   where expected.  Reports the time taken by bitmap_scan() and
+   by a bit-at-a-time reference scan over the same workload. */
+
+#include <bitmap.h>
+#include <stdio.h>
+#include "tests/threads/tests.h"
+#include "threads/malloc.h"
+#include "devices/timer.h"
+
+/* Bitmap size: enough bits for a 128 MB disk. */
+#define BIT_CNT (1 << 18)
+
+/* One free bit in every FREE_STRIDE bits, at FREE_OFS. */
+#define FREE_STRIDE 4096
+#define FREE_OFS 17
+#define FREE_CNT (BIT_CNT / FREE_STRIDE)
+
+/* One free run of RUN_CNT bits at RUN_OFS. */
+#define RUN_CNT 8
+#define RUN_OFS (BIT_CNT - 100)
+
+/* Number of times to repeat the workload. */
+#define ROUNDS 16
+
+static void free_bits (struct bitmap *);
+static size_t reference_scan (const struct bitmap *, size_t cnt);
+
+void
+test_bitmap_scan (void) 
+{
+  struct bitmap *b;
+  int64_t start_time;
+  size_t round, i;
+
+  b = bitmap_create (BIT_CNT);
+  if (b == NULL)
+    fail ("bitmap_create failed");
+
+  /* Check bitmap_scan() against the reference scan. */
+  free_bits (b);
+  if (bitmap_scan (b, 0, 1, false) != reference_scan (b, 1)
+      || bitmap_scan (b, 0, 2, false) != reference_scan (b, 2)
+      || bitmap_scan (b, 0, RUN_CNT, false) != RUN_OFS
+      || bitmap_scan (b, 0, RUN_CNT + 1, false) != BITMAP_ERROR)
+    fail ("bitmap_scan disagrees with reference scan");
+
+  start_time = timer_ticks ();
+  for (round = 0; round < ROUNDS; round++) 
+    {
+      free_bits (b);
+      for (i = 0; i < FREE_CNT; i++) 
+        {
+          size_t idx = bitmap_scan_and_flip (b, 0, 1, false);
+          if (idx != i * FREE_STRIDE + FREE_OFS)
+            fail ("allocation %zu returned bit %zu", i, idx);
+        }
+      if (bitmap_scan_and_flip (b, 0, RUN_CNT, false) != RUN_OFS)
+        fail ("run allocation failed");
+      if (bitmap_scan_and_flip (b, 0, 1, false) != BITMAP_ERROR)
+        fail ("allocation from full bitmap succeeded");
+    }
+  msg ("bitmap_scan: %d allocations in %lld ticks",
+       ROUNDS * (FREE_CNT + 2), timer_elapsed (start_time));
+
+  start_time = timer_ticks ();
+  free_bits (b);
+  for (i = 0; i < FREE_CNT; i++) 
+    {
+      size_t idx = reference_scan (b, 1);
+      if (idx != i * FREE_STRIDE + FREE_OFS)
+        fail ("reference allocation %zu returned bit %zu", i, idx);
+      bitmap_mark (b, idx);
+    }
+  msg ("reference scan: %d allocations in %lld ticks",
+       FREE_CNT, timer_elapsed (start_time));
+
+  bitmap_destroy (b);
+  pass ();
+}
+
+/* Sets every bit in B except the free bits and the free run. */
+static void
+free_bits (struct bitmap *b) 
+{
+  size_t i;
+
+  bitmap_set_all (b, true);
+  for (i = 0; i < FREE_CNT; i++)
+    bitmap_reset (b, i * FREE_STRIDE + FREE_OFS);
+  bitmap_set_multiple (b, RUN_OFS, RUN_CNT, false);
+}
+
+/* Returns the first group of CNT false bits in B, testing one
+   bit at a time, or BITMAP_ERROR if there is none. */
+static size_t
+reference_scan (const struct bitmap *b, size_t cnt) 
+{
+  size_t start, i;
+
+  for (start = 0; start + cnt <= bitmap_size (b); start++) 
+    {
+      for (i = 0; i < cnt; i++)
+        if (bitmap_test (b, start + i))
+          break;
+      if (i == cnt)
+        return start;
+    }
+  return BITMAP_ERROR;
+}
@@ -0,0 +1,14 @@
+# -*- perl -*-
+use strict;
+use warnings;
+use tests::tests;
+our ($test);
+
+# The timing lines vary from run to run, so check only that the
+# test ran to completion without failing.
+my (@output) = read_text_file ("$test.output");
+common_checks ("run", @output);
+@output = get_core_output ("run", @output);
+fail "Test did not pass.\n" if !grep (/^\(bitmap-scan\) PASS$/, @output);
+fail "Test did not end.\n" if !grep (/^\(bitmap-scan\) end$/, @output);
+pass;
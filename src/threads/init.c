@@ -36,6 +36,7 @@
 #include "devices/ide.h"
 #include "filesys/filesys.h"
 #include "filesys/fsutil.h"
+#include "filesys/cache.h"
 #endif
 
 #include "vm/frame.h"
@@ -256,6 +257,26 @@ parse_options (char **argv)
         filesys_bdev_name = value;
       else if (!strcmp (name, "-scratch"))
         scratch_bdev_name = value;
+      else if (!strcmp (name, "-cache"))
+        {
+          if (!cache_set_size (atoi (value)))
+            PANIC ("bad cache size `%s'", value);
+        }
+      else if (!strcmp (name, "-cache-policy"))
+        {
+          if (!cache_set_policy (value))
+            PANIC ("unknown cache policy `%s'", value);
+        }
+      else if (!strcmp (name, "-cache-flush"))
+        {
+          if (!cache_set_flush_interval (atoi (value)))
+            PANIC ("bad cache flush interval `%s'", value);
+        }
+      else if (!strcmp (name, "-cache-dirty"))
+        {
+          if (!cache_set_dirty_ratio (atoi (value)))
+            PANIC ("bad cache dirty percentage `%s'", value);
+        }
 #ifdef VM
       else if (!strcmp (name, "-swap"))
         swap_bdev_name = value;
@@ -382,6 +403,10 @@ usage (void)
           "  -f                 Format file system device during startup.\n"
           "  -filesys=BDEV      Use BDEV for file system instead of default.\n"
           "  -scratch=BDEV      Use BDEV for scratch instead of default.\n"
+          "  -cache=CNT         Cache CNT disk sectors in memory.\n"
+          "  -cache-policy=POL  Replace cache blocks by POL: clock or 2q.\n"
+          "  -cache-flush=MS    Write dirty cache blocks back every MS ms.\n"
+          "  -cache-dirty=PCT   Write back early once PCT%% of cache is dirty.\n"
 #ifdef VM
           "  -swap=BDEV         Use BDEV for swap instead of default.\n"
 #endif
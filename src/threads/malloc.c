@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
+#include "threads/interrupt.h"
 #include "threads/palloc.h"
 #include "threads/synch.h"
 #include "threads/vaddr.h"
@@ -64,8 +65,12 @@ struct block
 static struct desc descs[10];   /* Descriptors. */
 static size_t desc_cnt;         /* Number of descriptors. */
 
+/* Statistics. */
+static long long alloc_cnt;     /* Number of malloc() calls. */
+
 static struct arena *block_to_arena (struct block *);
 static struct block *arena_to_block (struct arena *, size_t idx);
+static void count_alloc (void);
 
 /* Initializes the malloc() descriptors. */
 void
@@ -84,6 +89,13 @@ malloc_init (void)
     }
 }
 
+/* Prints malloc() statistics. */
+void
+malloc_print_stats (void) 
+{
+  printf ("Malloc: %lld allocations\n", alloc_cnt);
+}
+
 /* Obtains and returns a new block of at least SIZE bytes.
    Returns a null pointer if memory is not available. */
 void *
@@ -96,6 +108,7 @@ malloc (size_t size)
   /* A null pointer satisfies a request for 0 bytes. */
   if (size == 0)
     return NULL;
+  count_alloc ();
 
   /* Find the smallest descriptor that satisfies a SIZE-byte
      request. */
@@ -292,3 +305,13 @@ arena_to_block (struct arena *a, size_t idx)
                            + sizeof *a
                            + idx * a->desc->block_size);
 }
+
+/* Counts a call to malloc().  The descriptors have separate
+   locks, so interrupts are turned off to update the count. */
+static void
+count_alloc (void) 
+{
+  enum intr_level old_level = intr_disable ();
+  alloc_cnt++;
+  intr_set_level (old_level);
+}
@@ -1,11 +1,13 @@
 #include "userprog/syscall.h"
 #include <stdio.h>
+#include <dirent.h>
 #include <syscall-nr.h>
 #include <string.h>
 #include "threads/interrupt.h"
 #include "threads/vaddr.h"
 #include "devices/shutdown.h"
 #include "userprog/process.h"
+#include "filesys/directory.h"
 #include "filesys/filesys.h"
 #include "threads/malloc.h"
 #include "threads/synch.h"
@@ -20,9 +22,6 @@ struct file_desc {
   struct list_elem elem;
 };
 
-static struct lock stupid_lock;
-//will make it reader writer lock in the future
-
 static int get_user(const uint8_t *uaddr);
 
 void syscall_init (void);
@@ -40,6 +39,7 @@ int sys_open(const char *file_name);
 
 static int sys_read (int handle, void *udst_, unsigned size);
 static int sys_write (int handle, void *usrc_, unsigned size);
+static int sys_getdents (int handle, void *udst_, unsigned size);
 
 static int sys_file_read_gen(struct file* f, void* dst, off_t size, off_t offset, bool is_at);
 static int sys_file_write_gen(struct file* f, const void* src, off_t size, off_t offset, bool is_at);
@@ -103,8 +103,6 @@ static int load_args(uint32_t* argv, void* src, uint8_t size) {
 
 void syscall_init (void) {
   intr_register_int (0x30, 3, INTR_ON, syscall_handler, "syscall");
-
-  lock_init(&stupid_lock);
 }
 
 
@@ -158,6 +156,16 @@ static void syscall_handler (struct intr_frame *f) {
       f->eax = sys_read(argv[0], (void*) argv[1], argv[2]);
       break;
 
+    case SYS_GETDENTS:
+      if (load_args(argv, f->esp+4, 3) == -1) {
+        sys_exit(-1);
+      }
+      if (!check_buffer((char*)argv[1], argv[2])) {
+        sys_exit(-1);
+      }
+      f->eax = sys_getdents(argv[0], (void*) argv[1], argv[2]);
+      break;
+
     case SYS_HALT:
       shutdown();
       break;
@@ -171,6 +179,11 @@ static void syscall_handler (struct intr_frame *f) {
         sys_exit(-1);
       f->eax = sys_filesys_remove((char*)argv[0]);
       break;
+    case SYS_MKDIR:
+      if ((load_args(argv, f->esp+4, 1) == -1)||(!check_string((char*)argv[0])))
+        sys_exit(-1);
+      f->eax = sys_mkdir((char*)argv[0]);
+      break;
 
     case SYS_OPEN:
       if ((load_args(argv, f->esp+4, 1) == -1)||(!check_string((char*)argv[0])))
@@ -357,6 +370,35 @@ sys_write (int handle, void *usrc_, unsigned size)
   return ret;
 }
 
+/* Fills the SIZE bytes at UDST_ with entries of directory HANDLE,
+   as many as fit, so that listing a directory takes a few calls
+   instead of one per entry.  The entries are gathered into a
+   kernel buffer a chunk at a time, so that the directory is not
+   locked while copying them out, which may page fault.  Returns the number of bytes
+   stored, 0 at the end of the directory, or -1 if HANDLE is not
+   a directory or SIZE is too small for the next entry. */
+static int
+sys_getdents (int handle, void *udst_, unsigned size)
+{
+  struct file_desc* F = search_fd(handle);
+  uint8_t *udst = udst_;
+  uint8_t buf[DIRENT_MAX * 8];
+  unsigned total = 0;
+
+  if (F == NULL || !inode_is_directory (file_get_inode (F->file)))
+    return -1;
+  while (total < size) {
+    unsigned chunk = size - total < sizeof buf ? size - total : sizeof buf;
+    /* struct dir and struct file share their layout. */
+    int n = dir_readdir_batch ((struct dir *) F->file, buf, chunk);
+    if (n <= 0)
+      return total == 0 ? n : (int) total;
+    memcpy(udst + total, buf, n);
+    total += n;
+  }
+  return total;
+}
+
 
 /*
 Managing the memory mapped files
@@ -489,41 +531,22 @@ static int sys_munmap (int mapping) {
 }
 
 
+/* The file system does its own locking: each inode serializes
+   changes to its length and block map, each directory its
+   entries, and the free map its bitmap.  So these wrappers call
+   straight through, and unrelated files are accessed in
+   parallel. */
 static int sys_file_read_gen(struct file* f, void* dst, off_t size, off_t offset, bool is_at){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  int ret;
-  if (is_at){
-    ret = file_read_at(f, dst, size, offset);
-  } else {
-    ret = file_read(f, dst, size);
-  }
-  //printf("%d-%s: Checking byte %x\n", thread_current()->tid,__func__, 0xff & (*(char*)(dst + 0xe40)));
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  if (is_at)
+    return file_read_at(f, dst, size, offset);
+  else
+    return file_read(f, dst, size);
 }
 static int sys_file_write_gen(struct file* f, const void* src, off_t size, off_t offset, bool is_at){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-  //printf("%d-%s: Checking byte %x\n", thread_current()->tid,__func__, 0xff & (*(char*)(src + 0xe40)));
-  int ret;
-  if (is_at){
-    ret = file_write_at(f, src, size, offset);
-  } else {
-    ret = file_write(f, src, size);
-  }
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  if (is_at)
+    return file_write_at(f, src, size, offset);
+  else
+    return file_write(f, src, size);
 }
 int sys_file_read(struct file* f, void* dst, off_t size){
   return sys_file_read_gen(f, dst, size, 0, false);
@@ -540,130 +563,37 @@ int sys_file_write_at(struct file* f, const void* src, off_t size, off_t offset)
 
 
 bool sys_filesys_create (const char *name, off_t initial_size){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  bool ret = filesys_create (name, initial_size);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  return filesys_create (name, initial_size, FILE_INODE);
 }
 
 struct file* sys_filesys_open (const char* name){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  struct file* ret = filesys_open(name);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  return filesys_open(name);
 }
 
 bool sys_filesys_remove (const char *name){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  bool ret = filesys_remove (name);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  return filesys_remove (name);
+}
+bool sys_mkdir (const char *name){
+  return filesys_create (name, 0, DIR_INODE);
 }
 struct file* sys_file_reopen (struct file * f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  struct file* ret = file_reopen(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  return file_reopen(f);
 }
 void sys_file_close (struct file * f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
   file_close(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
 }
 void sys_file_deny_write (struct file * f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
   file_deny_write(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
 }
 void sys_file_allow_write (struct file * f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
   file_allow_write(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
 }
 void sys_file_seek(struct file* f, off_t offset){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
   file_seek(f, offset);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
 }
 off_t sys_file_tell(struct file* f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  off_t ret = file_tell(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
+  return file_tell(f);
 }
 off_t sys_file_length(struct file* f){
-  bool already_held = lock_held_by_current_thread(&stupid_lock);
-  if (!already_held){
-    lock_acquire(&stupid_lock);  
-  }
-
-  off_t ret = file_length(f);
-
-  if (!already_held){
-    lock_release(&stupid_lock);
-  }
-  return ret;
-}
\ No newline at end of file
+  return file_length(f);
+}
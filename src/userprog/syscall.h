@@ -36,6 +36,7 @@ int sys_file_write_at(struct file* f, const void* src, off_t size, off_t offset)
 bool sys_filesys_create (const char *name, off_t initial_size);
 struct file* sys_filesys_open (const char* name);
 bool sys_filesys_remove (const char *name);
+bool sys_mkdir (const char *name);
 
 struct file* sys_file_reopen (struct file * f);
 void sys_file_close (struct file * f);
@@ -123,8 +123,9 @@ bool page_in (void *fault_addr) {
 		// show_page(p);
 	} else if (p->file){
 		//from file
-		sys_file_seek(p->file, p->file_offset);
-		if (sys_file_read(p->file, kpage, p->file_bytes/*, p->file_offset*/) != (int) p->file_bytes){
+		//positional, so that concurrent page-ins of one file
+		//do not race on its position
+		if (sys_file_read_at(p->file, kpage, p->file_bytes, p->file_offset) != (int) p->file_bytes){
 			// page_deallocate(fault_addr);
   			//////printf("%d-%s: Failed to read a page\n", thread_current()->tid, __func__);
 			goto done;